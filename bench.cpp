@@ -0,0 +1,343 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "hnsw.h"
+#include "dataset.h"
+
+// benchmark driver: every index of a config file is built (or loaded) once, then the whole query set is run
+// at each query-time ef, with warm-up passes and repeated timed trials. reports recall@k, qps, latency
+// percentiles and distance counts per run and marks the runs on the recall / qps pareto front.
+// see bench.conf for the config format. usage: bench [config file], bench.conf by default.
+
+struct index_config {
+    int m = 16;
+    int m_max = 16;
+    int m_max_0 = 32;
+    int ef_construction = 100;
+    float ml = 1.0;
+    std::string mode = "heuristic";
+    std::string file;                            // index file, loaded when it exists, written after a build
+};
+
+struct bench_config {
+    std::string base;
+    std::string query;
+    std::string groundtruth;                     // computed with exact_knn when empty
+    std::string output = "bench";                // output.csv and output.json are written
+    std::string metric = "l2";
+    int k = 10;
+    size_t build_threads = 0;
+    size_t max_queries = 0;                      // 0 = all queries
+    int warmup = 1;
+    int trials = 3;
+    std::vector<int> ef;
+    std::vector<index_config> indexes;
+};
+
+// one ef of one index
+struct run_result {
+    size_t index = 0;
+    int ef = 0;
+    double recall = 0;
+    double qps = 0;                              // median over the trials
+    double p50_us = 0;
+    double p90_us = 0;
+    double p99_us = 0;
+    double distances_per_query = 0;
+    double hops_per_query = 0;
+    bool pareto = false;
+};
+
+struct index_result {
+    double build_time_s = 0;
+    double load_time_s = 0;
+    size_t memory_bytes = 0;
+};
+
+// "key = value" lines, '#' starts a comment. "index" lines take space separated key=value pairs and may be
+// repeated, "ef" takes a list of values.
+bench_config parse_config(const std::string &path) {
+    std::ifstream fd(path);
+    if (!fd.is_open()) {
+        throw std::runtime_error(path + ": cannot open");
+    }
+    bench_config config;
+    std::string line;
+    for (int line_number = 1; getline(fd, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        std::istringstream words(line);
+        std::string key;
+        if (!(words >> key)) {
+            continue;
+        }
+        auto error = [&](const std::string &what) {
+            return std::runtime_error(path + ":" + std::to_string(line_number) + ": " + what);
+        };
+        try {
+            if (key == "index") {
+                index_config index;
+                std::string pair;
+                while (words >> pair) {
+                    size_t p = pair.find('=');
+                    if (p == std::string::npos) {
+                        throw error("expected key=value, got " + pair);
+                    }
+                    std::string name = pair.substr(0, p), value = pair.substr(p + 1);
+                    if (name == "m") {
+                        index.m = std::stoi(value);
+                    } else if (name == "m_max") {
+                        index.m_max = std::stoi(value);
+                    } else if (name == "m_max_0") {
+                        index.m_max_0 = std::stoi(value);
+                    } else if (name == "ef_construction") {
+                        index.ef_construction = std::stoi(value);
+                    } else if (name == "ml") {
+                        index.ml = std::stof(value);
+                    } else if (name == "mode") {
+                        index.mode = value;
+                    } else if (name == "file") {
+                        index.file = value;
+                    } else {
+                        throw error("unknown index parameter " + name);
+                    }
+                }
+                config.indexes.push_back(index);
+                continue;
+            }
+            if (eq == std::string::npos) {
+                throw error("expected key = value");
+            }
+            key = line.substr(0, eq);
+            key.erase(std::remove_if(key.begin(), key.end(), ::isspace), key.end());
+            std::istringstream values(line.substr(eq + 1));
+            std::string value;
+            values >> value;
+            if (key == "base") {
+                config.base = value;
+            } else if (key == "query") {
+                config.query = value;
+            } else if (key == "groundtruth") {
+                config.groundtruth = value;
+            } else if (key == "output") {
+                config.output = value;
+            } else if (key == "metric") {
+                config.metric = value;
+            } else if (key == "k") {
+                config.k = std::stoi(value);
+            } else if (key == "build_threads") {
+                config.build_threads = std::stoul(value);
+            } else if (key == "max_queries") {
+                config.max_queries = std::stoul(value);
+            } else if (key == "warmup") {
+                config.warmup = std::stoi(value);
+            } else if (key == "trials") {
+                config.trials = std::stoi(value);
+            } else if (key == "ef") {
+                config.ef.clear();
+                for (std::istringstream all(line.substr(eq + 1)); all >> value;) {
+                    config.ef.push_back(std::stoi(value));
+                }
+            } else {
+                throw error("unknown key " + key);
+            }
+        } catch (const std::invalid_argument &) {
+            throw error("not a number");
+        }
+    }
+    if (config.base.empty() || config.query.empty()) {
+        throw std::runtime_error(path + ": base and query are required");
+    }
+    if (config.ef.empty() || config.indexes.empty() || config.trials < 1 || config.k < 1) {
+        throw std::runtime_error(path + ": at least one ef, one index, one trial and k >= 1 are needed");
+    }
+    return config;
+}
+
+double percentile(std::vector<double> sorted, double p) {
+    std::sort(sorted.begin(), sorted.end());
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+// a run is on the front when no other run has both a higher recall and a higher qps
+void mark_pareto(std::vector<run_result> &runs) {
+    for (run_result &r: runs) {
+        r.pareto = std::none_of(runs.begin(), runs.end(), [&](const run_result &o) {
+            return o.recall >= r.recall && o.qps >= r.qps && (o.recall > r.recall || o.qps > r.qps);
+        });
+    }
+}
+
+void write_results(const bench_config &config, const std::string &config_path, size_t points, size_t queries,
+                   size_t dim, double data_load_time, const std::vector<index_result> &indexes,
+                   const std::vector<run_result> &runs) {
+    std::ofstream csv(config.output + ".csv");
+    csv << "index,m,m_max,m_max_0,ef_construction,ml,mode,build_time_s,load_time_s,k,ef,recall,qps,p50_us,p90_us,"
+           "p99_us,distances_per_query,hops_per_query,pareto\n";
+    for (const run_result &r: runs) {
+        const index_config &c = config.indexes[r.index];
+        const index_result &i = indexes[r.index];
+        csv << r.index << "," << c.m << "," << c.m_max << "," << c.m_max_0 << "," << c.ef_construction << ","
+            << c.ml << "," << c.mode << "," << i.build_time_s << "," << i.load_time_s << "," << config.k << ","
+            << r.ef << "," << r.recall << "," << r.qps << "," << r.p50_us << "," << r.p90_us << "," << r.p99_us
+            << "," << r.distances_per_query << "," << r.hops_per_query << "," << r.pareto << "\n";
+    }
+
+    std::ofstream json(config.output + ".json");
+    json << "{\n  \"schema_version\": 1,\n  \"config\": \"" << config_path << "\",\n  \"metric\": \"" << config.metric
+         << "\",\n  \"k\": " << config.k << ",\n  \"trials\": " << config.trials << ",\n  \"warmup\": "
+         << config.warmup << ",\n  \"data\": {\"base\": \"" << config.base << "\", \"points\": " << points
+         << ", \"queries\": " << queries << ", \"dim\": " << dim << ", \"load_time_s\": " << data_load_time
+         << "},\n  \"indexes\": [";
+    for (size_t n = 0; n < indexes.size(); n++) {
+        const index_config &c = config.indexes[n];
+        json << (n == 0 ? "\n" : ",\n") << "    {\"index\": " << n << ", \"m\": " << c.m << ", \"m_max\": "
+             << c.m_max << ", \"m_max_0\": " << c.m_max_0 << ", \"ef_construction\": " << c.ef_construction
+             << ", \"ml\": " << c.ml << ", \"mode\": \"" << c.mode << "\", \"build_time_s\": "
+             << indexes[n].build_time_s << ", \"load_time_s\": " << indexes[n].load_time_s
+             << ", \"memory_bytes\": " << indexes[n].memory_bytes << "}";
+    }
+    json << "\n  ],\n  \"runs\": [";
+    for (size_t n = 0; n < runs.size(); n++) {
+        const run_result &r = runs[n];
+        json << (n == 0 ? "\n" : ",\n") << "    {\"index\": " << r.index << ", \"ef\": " << r.ef << ", \"recall\": "
+             << r.recall << ", \"qps\": " << r.qps << ", \"p50_us\": " << r.p50_us << ", \"p90_us\": " << r.p90_us
+             << ", \"p99_us\": " << r.p99_us << ", \"distances_per_query\": " << r.distances_per_query
+             << ", \"hops_per_query\": " << r.hops_per_query << ", \"pareto\": " << (r.pareto ? "true" : "false")
+             << "}";
+    }
+    json << "\n  ]\n}\n";
+}
+
+template<typename Metric>
+void run_benchmark(const bench_config &config, const std::string &config_path) {
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    vecs_data<float> base = load_fvecs_data(config.base);
+    vecs_data<float> queries = load_fvecs_data(config.query);
+    if (config.max_queries != 0 && config.max_queries < queries.size()) {
+        queries = queries.slice(0, config.max_queries);
+    }
+    double data_load_time = duration<double>(steady_clock::now() - start).count();
+    std::cout << "data: " << base.size() << " points, " << queries.size() << " queries, load time (s): "
+              << data_load_time << std::endl;
+
+    // ground truth ids, the first k of each row
+    size_t k = config.k;
+    std::vector<std::unordered_set<label_t> > truth(queries.size());
+    if (!config.groundtruth.empty()) {
+        vecs_data<int32_t> groundtruth = load_ivecs_data(config.groundtruth);
+        if (groundtruth.size() < queries.size() || groundtruth.dim() < k) {
+            throw std::runtime_error(config.groundtruth + ": fewer rows or neighbors than queries and k");
+        }
+        for (size_t i = 0; i < queries.size(); i++) {
+            truth[i].insert(groundtruth[i], groundtruth[i] + k);
+        }
+    } else {
+        start = steady_clock::now();
+        exact_knn_result exact = exact_knn<Metric>(base, queries, k);
+        for (size_t i = 0; i < queries.size(); i++) {
+            truth[i].insert(exact.ids.begin() + i * k, exact.ids.begin() + (i + 1) * k);
+        }
+        std::cout << "ground truth computed in (s): " << duration<double>(steady_clock::now() - start).count()
+                  << std::endl;
+    }
+
+    std::vector<index_result> index_results;
+    std::vector<run_result> runs;
+    for (size_t n = 0; n < config.indexes.size(); n++) {
+        const index_config &c = config.indexes[n];
+        basic_hnsw<Metric> index(c.m, c.m_max, c.m_max_0, c.ef_construction, c.ml, c.mode);
+        index.set_num_threads(config.build_threads);
+        index_result built;
+        struct stat st{};
+        if (!c.file.empty() && ::stat(c.file.c_str(), &st) == 0) {
+            start = steady_clock::now();
+            index.load(c.file);
+            built.load_time_s = duration<double>(steady_clock::now() - start).count();
+        } else {
+            start = steady_clock::now();
+            index.build_graph(base);
+            built.build_time_s = duration<double>(steady_clock::now() - start).count();
+            if (!c.file.empty()) {
+                index.save(c.file);
+            }
+        }
+        built.memory_bytes = index.memory_usage();
+        index_results.push_back(built);
+        std::cout << "index " << n << ": m=" << c.m << ", m_max=" << c.m_max << ", m_max_0=" << c.m_max_0
+                  << ", ef_construction=" << c.ef_construction << ", mode=" << c.mode << ", build time (s): "
+                  << built.build_time_s << ", load time (s): " << built.load_time_s << std::endl;
+
+        search_context ctx;
+        std::vector<search_result> result(k);
+        for (int ef: config.ef) {
+            for (int w = 0; w < config.warmup; w++) {
+                for (size_t i = 0; i < queries.size(); i++) {
+                    index.knn_search(ctx, queries[i], k, ef, result.data());
+                }
+            }
+            std::vector<double> latencies, trial_qps;
+            size_t hits = 0;
+            ctx.stats = search_stats();
+            for (int t = 0; t < config.trials; t++) {
+                auto trial_start = steady_clock::now();
+                for (size_t i = 0; i < queries.size(); i++) {
+                    auto query_start = steady_clock::now();
+                    size_t count = index.knn_search(ctx, queries[i], k, ef, result.data());
+                    latencies.push_back(duration<double, std::micro>(steady_clock::now() - query_start).count());
+                    if (t == 0) {
+                        for (size_t j = 0; j < count; j++) {
+                            hits += truth[i].count(result[j].label);
+                        }
+                    }
+                }
+                trial_qps.push_back(queries.size() / duration<double>(steady_clock::now() - trial_start).count());
+            }
+            run_result r;
+            r.index = n;
+            r.ef = ef;
+            r.recall = (double) hits / (queries.size() * k);
+            r.qps = percentile(trial_qps, 0.5);
+            r.p50_us = percentile(latencies, 0.5);
+            r.p90_us = percentile(latencies, 0.9);
+            r.p99_us = percentile(latencies, 0.99);
+            r.distances_per_query = (double) ctx.stats.distance_calculation_count / ctx.stats.queries;
+            r.hops_per_query = (double) ctx.stats.hops / ctx.stats.queries;
+            runs.push_back(r);
+            std::cout << "  ef: " << ef << ", recall: " << r.recall << ", qps: " << r.qps << ", p50 (us): "
+                      << r.p50_us << ", p99 (us): " << r.p99_us << ", distances per query: "
+                      << r.distances_per_query << std::endl;
+        }
+    }
+    mark_pareto(runs);
+    write_results(config, config_path, base.size(), queries.size(), base.dim(), data_load_time, index_results, runs);
+    std::cout << "results written to " << config.output << ".csv and " << config.output << ".json" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::string config_path = argc > 1 ? argv[1] : "bench.conf";
+    try {
+        bench_config config = parse_config(config_path);
+        if (config.metric == "l2") {
+            run_benchmark<metric_l2>(config, config_path);
+        } else if (config.metric == "ip") {
+            run_benchmark<metric_ip>(config, config_path);
+        } else if (config.metric == "cosine") {
+            run_benchmark<metric_cosine>(config, config_path);
+        } else {
+            throw std::runtime_error("unknown metric " + config.metric);
+        }
+    } catch (const std::exception &e) {
+        std::cout << "error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "distance.h"
+
+// times every l2 and inner product kernel the cpu supports, generic and dimension-specialized, and prints ns per
+// distance
+int main(int argc, char **argv) {
+    const size_t num = 4096;                 // small enough to stay in cache, we measure the kernel not memory
+    const size_t total_distances = 20000000;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dis(0, 128);
+
+    std::cout << "best kernel: " << simd_level_name(cpu_simd_level()) << std::endl;
+    std::cout << "dim,metric,kernel,specialized,ns_per_distance,checksum" << std::endl;
+    for (size_t dim: {25, 100, 128, 200, 960}) {
+        std::vector<float> base(num * dim);
+        std::vector<float> query(dim);
+        for (float &f: base) {
+            f = dis(gen);
+        }
+        for (float &f: query) {
+            f = dis(gen);
+        }
+
+        for (bool ip: {false, true}) {
+            for (simd_level level: supported_simd_levels()) {
+                for (bool specialized: {false, true}) {
+                    dist_func_t generic = ip ? ip_kernel<0>(level) : l2_sqr_kernel<0>(level);
+                    dist_func_t f = !specialized ? generic : ip ? get_ip(dim, level) : get_l2_sqr(dim, level);
+                    if (specialized && f == generic) {
+                        continue; // no specialization for this dimension
+                    }
+                    double checksum = 0;
+                    size_t rounds = total_distances / num / (dim / 32 + 1);
+                    auto start = std::chrono::high_resolution_clock::now();
+                    for (size_t r = 0; r < rounds; r++) {
+                        for (size_t i = 0; i < num; i++) {
+                            checksum += f(query.data(), base.data() + i * dim, dim);
+                        }
+                    }
+                    auto end = std::chrono::high_resolution_clock::now();
+                    double ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                    std::cout << dim << "," << (ip ? "ip" : "l2") << "," << simd_level_name(level) << ","
+                              << (specialized ? "yes" : "no") << "," << ns / (rounds * num) << ","
+                              << checksum / (rounds * num) << std::endl;
+                }
+            }
+        }
+    }
+    return 0;
+}
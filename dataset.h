@@ -0,0 +1,186 @@
+#ifndef UNTITLED_DATASET_H
+#define UNTITLED_DATASET_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include "mapped_file.h"
+
+// a set of dim-sized rows of T. rows either live in place in a memory-mapped .fvecs/.ivecs/.bvecs file,
+// where every row is an int32 dimension followed by dim values, or in memory owned by the object.
+// copies and slices share the mapping, so passing a vecs_data around never copies rows.
+template<typename T>
+class vecs_data {
+private:
+    std::shared_ptr<mapped_file> file;
+    std::shared_ptr<std::vector<T> > owned;
+    const char *base = nullptr;                  // first value of row 0
+    size_t num = 0;
+    size_t d = 0;
+    size_t row_bytes = 0;                        // distance between two consecutive rows
+
+public:
+    vecs_data() = default;
+
+    // maps a file of the vecs family, throws runtime_error when the file is missing or malformed
+    static vecs_data map_file(const std::string &filename) {
+        vecs_data data;
+        data.file = std::make_shared<mapped_file>(filename);
+        size_t size = data.file->size();
+        if (size == 0) {
+            return data;
+        }
+        int32_t dim;
+        if (size < sizeof(int32_t)) {
+            throw std::runtime_error(filename + ": file too small");
+        }
+        std::memcpy(&dim, data.file->data(), sizeof(int32_t));
+        if (dim <= 0) {
+            throw std::runtime_error(filename + ": invalid dimension " + std::to_string(dim));
+        }
+        data.d = dim;
+        data.row_bytes = sizeof(int32_t) + data.d * sizeof(T);
+        if (size % data.row_bytes != 0) {
+            throw std::runtime_error(filename + ": size is not a multiple of the row size, wrong file type?");
+        }
+        data.num = size / data.row_bytes;
+        data.base = data.file->data() + sizeof(int32_t);
+
+        // every row repeats the dimension, checking the last one catches most mismatched files for free
+        std::memcpy(&dim, data.file->data() + (data.num - 1) * data.row_bytes, sizeof(int32_t));
+        if ((size_t) dim != data.d) {
+            throw std::runtime_error(filename + ": rows have different dimensions");
+        }
+        return data;
+    }
+
+    // takes ownership of rows held in memory, all rows must have the same size
+    static vecs_data from_rows(const std::vector<std::vector<T> > &rows) {
+        vecs_data data;
+        data.num = rows.size();
+        data.d = rows.empty() ? 0 : rows[0].size();
+        data.row_bytes = data.d * sizeof(T);
+        data.owned = std::make_shared<std::vector<T> >();
+        data.owned->reserve(data.num * data.d);
+        for (const std::vector<T> &row: rows) {
+            if (row.size() != data.d) {
+                throw std::runtime_error("vecs_data: rows have different dimensions");
+            }
+            data.owned->insert(data.owned->end(), row.begin(), row.end());
+        }
+        data.base = reinterpret_cast<const char *>(data.owned->data());
+        return data;
+    }
+
+    size_t size() const {
+        return num;
+    }
+
+    size_t dim() const {
+        return d;
+    }
+
+    // zero-copy view of row i
+    const T *operator[](size_t i) const {
+        return reinterpret_cast<const T *>(base + i * row_bytes);
+    }
+
+    // rows [begin, end) as a view sharing the same storage, for building or querying in chunks
+    vecs_data slice(size_t begin, size_t end) const {
+        if (begin > end || end > num) {
+            throw std::out_of_range("vecs_data: slice out of range");
+        }
+        vecs_data data = *this;
+        data.base = base + begin * row_bytes;
+        data.num = end - begin;
+        return data;
+    }
+
+    void read_row(size_t i, float *out) const {
+        const T *row = (*this)[i];
+        for (size_t j = 0; j < d; j++) {
+            out[j] = (float) row[j];
+        }
+    }
+
+    // converts rows [begin, end) to float into out, dim floats per row
+    void read_rows(size_t begin, size_t end, float *out) const {
+        for (size_t i = begin; i < end; i++) {
+            read_row(i, out + (i - begin) * d);
+        }
+    }
+
+    // in-memory float copy, e.g. to query with .bvecs data
+    vecs_data<float> to_float() const {
+        std::vector<std::vector<float> > rows(num, std::vector<float>(d));
+        for (size_t i = 0; i < num; i++) {
+            read_row(i, rows[i].data());
+        }
+        return vecs_data<float>::from_rows(rows);
+    }
+};
+
+inline vecs_data<float> load_fvecs_data(const std::string &filename) {
+    return vecs_data<float>::map_file(filename);
+}
+
+inline vecs_data<int32_t> load_ivecs_data(const std::string &filename) {
+    return vecs_data<int32_t>::map_file(filename);
+}
+
+inline vecs_data<uint8_t> load_bvecs_data(const std::string &filename) {
+    return vecs_data<uint8_t>::map_file(filename);
+}
+
+// writes n rows of dim values in the vecs layout, every row an int32 dimension followed by its values.
+// T = float gives an .fvecs file, int32_t an .ivecs file and uint8_t a .bvecs file.
+template<typename T>
+void save_vecs_data(const std::string &filename, const T *values, size_t n, size_t dim) {
+    std::ofstream fd(filename, std::ios::binary);
+    if (!fd.is_open()) {
+        throw std::runtime_error(filename + ": cannot open for writing");
+    }
+    int32_t d = (int32_t) dim;
+    for (size_t i = 0; i < n; i++) {
+        fd.write(reinterpret_cast<const char *>(&d), sizeof(int32_t));
+        fd.write(reinterpret_cast<const char *>(values + i * dim), dim * sizeof(T));
+    }
+    if (!fd) {
+        throw std::runtime_error(filename + ": write failed");
+    }
+}
+
+inline void save_ivecs_data(const std::string &filename, const std::vector<int32_t> &values, size_t dim) {
+    save_vecs_data(filename, values.data(), dim == 0 ? 0 : values.size() / dim, dim);
+}
+
+// one row per line, values separated by spaces
+template<typename T = float>
+vecs_data<T> load_txt_data(const std::string &filename) {
+    std::ifstream fd(filename);
+    if (!fd.is_open()) {
+        throw std::runtime_error(filename + ": cannot open");
+    }
+    std::vector<std::vector<T> > results;
+    std::string temp;
+    while (getline(fd, temp)) {
+        std::vector<T> f;
+        // split the line by space
+        std::istringstream iss(temp);
+        std::string token;
+        while (getline(iss, token, ' ')) {
+            if (!token.empty()) {
+                f.push_back((T) std::stof(token));
+            }
+        }
+        results.push_back(f);
+    }
+    return vecs_data<T>::from_rows(results);
+}
+
+#endif //UNTITLED_DATASET_H
@@ -0,0 +1,68 @@
+#ifndef UNTITLED_DIAGNOSTICS_H
+#define UNTITLED_DIAGNOSTICS_H
+
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+// graph health of one layer as computed by basic_hnsw::diagnose. only live points count: deleted points are
+// neither nodes nor link targets here, but searches still walk through them, so reachability goes through them.
+struct layer_diagnostics {
+    int level = 0;
+    size_t nodes = 0;
+    size_t links = 0;
+    uint32_t min_degree = 0;
+    uint32_t max_degree = 0;
+    double mean_degree = 0;
+    std::vector<size_t> degree_histogram;        // nodes with 0, 1, 2, ... links
+
+    // in-degree skew. hubs show up as a large max and cv, top_percent_share is the fraction of all links
+    // that point to the 1% most linked nodes.
+    uint32_t max_in_degree = 0;
+    double in_degree_cv = 0;
+    size_t zero_in_degree = 0;                   // nodes no link points to, the enter point excepted
+    double top_percent_share = 0;
+
+    size_t unreachable = 0;                      // nodes not reached from the enter point on this layer
+
+    // fraction of the links of the sampled nodes that are among as many exact nearest neighbors in the layer,
+    // not computed (0 samples) once the fp32 vectors were released
+    size_t link_recall_samples = 0;
+    double link_recall = 0;
+};
+
+struct graph_diagnostics {
+    size_t elements = 0;
+    size_t deleted = 0;
+    uint32_t enter_point = 0;
+    double seconds = 0;
+    std::vector<layer_diagnostics> layers;
+
+    void write_json(std::ostream &out) const {
+        out << "{\n  \"elements\": " << elements << ",\n  \"deleted\": " << deleted << ",\n  \"enter_point\": "
+            << enter_point << ",\n  \"seconds\": " << seconds << ",\n  \"layers\": [";
+        for (size_t i = 0; i < layers.size(); i++) {
+            const layer_diagnostics &l = layers[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"level\": " << l.level << ", \"nodes\": " << l.nodes
+                << ", \"links\": " << l.links << ", \"min_degree\": " << l.min_degree << ", \"max_degree\": "
+                << l.max_degree << ", \"mean_degree\": " << l.mean_degree << ", \"degree_histogram\": [";
+            for (size_t d = 0; d < l.degree_histogram.size(); d++) {
+                out << (d == 0 ? "" : ", ") << l.degree_histogram[d];
+            }
+            out << "], \"max_in_degree\": " << l.max_in_degree << ", \"in_degree_cv\": " << l.in_degree_cv
+                << ", \"zero_in_degree\": " << l.zero_in_degree << ", \"top_percent_share\": " << l.top_percent_share
+                << ", \"unreachable\": " << l.unreachable << ", \"link_recall_samples\": " << l.link_recall_samples
+                << ", \"link_recall\": ";
+            if (l.link_recall_samples == 0) {
+                out << "null";
+            } else {
+                out << l.link_recall;
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+#endif //UNTITLED_DIAGNOSTICS_H
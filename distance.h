@@ -0,0 +1,426 @@
+#ifndef UNTITLED_DISTANCE_H
+#define UNTITLED_DISTANCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HNSW_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HNSW_NEON 1
+#endif
+
+// l2 kernels return the squared l2 distance, ranking does not need the root.
+// inner product kernels return 1 - <a, b>, so that for every metric a smaller distance is nearer
+typedef float (*dist_func_t)(const float *, const float *, size_t);
+
+enum class simd_level {
+    scalar, sse, avx2, avx512, neon
+};
+
+inline const char *simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::sse:
+            return "sse";
+        case simd_level::avx2:
+            return "avx2";
+        case simd_level::avx512:
+            return "avx512";
+        case simd_level::neon:
+            return "neon";
+        default:
+            return "scalar";
+    }
+}
+
+// kernels are templated on the dimension so that common sizes get a fully unrolled loop,
+// D = 0 means the dimension is only known at runtime
+template<size_t D>
+float l2_sqr_scalar(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    float dist = 0;
+    for (size_t i = 0; i < n; i++) {
+        float d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+template<size_t D>
+float ip_scalar(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    float dot = 0;
+    for (size_t i = 0; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return 1 - dot;
+}
+
+#ifdef HNSW_X86
+
+template<size_t D>
+float l2_sqr_sse(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float dist = _mm_cvtss_f32(sum);
+    if (n % 4 != 0) {
+        dist += l2_sqr_scalar<0>(a + i, b + i, n - i);
+    }
+    return dist;
+}
+
+template<size_t D>
+__attribute__((target("avx2,fma")))
+float l2_sqr_avx2(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    if (i + 8 <= n) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        i += 8;
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+    if (i + 4 <= n) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum = _mm_fmadd_ps(d, d, sum);
+        i += 4;
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float dist = _mm_cvtss_f32(sum);
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+template<size_t D>
+__attribute__((target("avx512f")))
+float l2_sqr_avx512(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+    }
+    if (i + 16 <= n) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        i += 16;
+    }
+    if (i < n) {
+        // masked loads take care of the tail without a scalar loop
+        __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+template<size_t D>
+float ip_sse(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float dot = _mm_cvtss_f32(sum);
+    if (n % 4 != 0) {
+        dot += 1 - ip_scalar<0>(a + i, b + i, n - i);
+    }
+    return 1 - dot;
+}
+
+template<size_t D>
+__attribute__((target("avx2,fma")))
+float ip_avx2(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    if (i + 8 <= n) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        i += 8;
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+    if (i + 4 <= n) {
+        sum = _mm_fmadd_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i), sum);
+        i += 4;
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    float dot = _mm_cvtss_f32(sum);
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return 1 - dot;
+}
+
+template<size_t D>
+__attribute__((target("avx512f")))
+float ip_avx512(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+    }
+    if (i + 16 <= n) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        i += 16;
+    }
+    if (i < n) {
+        __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+    }
+    return 1 - _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+#endif
+
+#ifdef HNSW_NEON
+
+template<size_t D>
+float l2_sqr_neon(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        sum0 = vfmaq_f32(sum0, d0, d0);
+        sum1 = vfmaq_f32(sum1, d1, d1);
+    }
+    if (i + 4 <= n) {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        sum0 = vfmaq_f32(sum0, d0, d0);
+        i += 4;
+    }
+    float dist = vaddvq_f32(vaddq_f32(sum0, sum1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        dist += d * d;
+    }
+    return dist;
+}
+
+template<size_t D>
+float ip_neon(const float *a, const float *b, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    if (i + 4 <= n) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        i += 4;
+    }
+    float dot = vaddvq_f32(vaddq_f32(sum0, sum1));
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return 1 - dot;
+}
+
+#endif
+
+inline simd_level detect_simd_level() {
+#ifdef HNSW_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return simd_level::avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return simd_level::avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return simd_level::sse;
+    }
+    return simd_level::scalar;
+#elif defined(HNSW_NEON)
+    return simd_level::neon;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+// cpu features are probed once, on first use
+inline simd_level cpu_simd_level() {
+    static const simd_level level = detect_simd_level();
+    return level;
+}
+
+// every level the running cpu can execute, from slowest to fastest
+inline std::vector<simd_level> supported_simd_levels() {
+    std::vector<simd_level> levels{simd_level::scalar};
+    simd_level best = cpu_simd_level();
+#ifdef HNSW_X86
+    for (simd_level level: {simd_level::sse, simd_level::avx2, simd_level::avx512}) {
+        if (level <= best) {
+            levels.push_back(level);
+        }
+    }
+#elif defined(HNSW_NEON)
+    levels.push_back(best);
+#endif
+    return levels;
+}
+
+template<size_t D>
+dist_func_t l2_sqr_kernel(simd_level level) {
+    switch (level) {
+#ifdef HNSW_X86
+        case simd_level::avx512:
+            return l2_sqr_avx512<D>;
+        case simd_level::avx2:
+            return l2_sqr_avx2<D>;
+        case simd_level::sse:
+            return l2_sqr_sse<D>;
+#endif
+#ifdef HNSW_NEON
+        case simd_level::neon:
+            return l2_sqr_neon<D>;
+#endif
+        default:
+            return l2_sqr_scalar<D>;
+    }
+}
+
+// returns the fastest kernel for the dimension, specialized for sift (128) and glove (25/100/200)
+inline dist_func_t get_l2_sqr(size_t dim, simd_level level = cpu_simd_level()) {
+    switch (dim) {
+        case 25:
+            return l2_sqr_kernel<25>(level);
+        case 100:
+            return l2_sqr_kernel<100>(level);
+        case 128:
+            return l2_sqr_kernel<128>(level);
+        case 200:
+            return l2_sqr_kernel<200>(level);
+        default:
+            return l2_sqr_kernel<0>(level);
+    }
+}
+
+template<size_t D>
+dist_func_t ip_kernel(simd_level level) {
+    switch (level) {
+#ifdef HNSW_X86
+        case simd_level::avx512:
+            return ip_avx512<D>;
+        case simd_level::avx2:
+            return ip_avx2<D>;
+        case simd_level::sse:
+            return ip_sse<D>;
+#endif
+#ifdef HNSW_NEON
+        case simd_level::neon:
+            return ip_neon<D>;
+#endif
+        default:
+            return ip_scalar<D>;
+    }
+}
+
+inline dist_func_t get_ip(size_t dim, simd_level level = cpu_simd_level()) {
+    switch (dim) {
+        case 25:
+            return ip_kernel<25>(level);
+        case 100:
+            return ip_kernel<100>(level);
+        case 128:
+            return ip_kernel<128>(level);
+        case 200:
+            return ip_kernel<200>(level);
+        default:
+            return ip_kernel<0>(level);
+    }
+}
+
+// metrics an index is specialized on. kernel picks the simd kernel for a dimension, normalize says whether
+// vectors and queries are scaled to unit length before use, id is stored in index files.
+struct metric_l2 {
+    static constexpr const char *name = "l2";
+    static constexpr uint32_t id = 0;
+    static constexpr bool normalize = false;
+
+    static dist_func_t kernel(size_t dim, simd_level level = cpu_simd_level()) {
+        return get_l2_sqr(dim, level);
+    }
+};
+
+struct metric_ip {
+    static constexpr const char *name = "ip";
+    static constexpr uint32_t id = 1;
+    static constexpr bool normalize = false;
+
+    static dist_func_t kernel(size_t dim, simd_level level = cpu_simd_level()) {
+        return get_ip(dim, level);
+    }
+};
+
+// cosine distance 1 - cos(a, b), computed as the inner product of normalized vectors
+struct metric_cosine {
+    static constexpr const char *name = "cosine";
+    static constexpr uint32_t id = 2;
+    static constexpr bool normalize = true;
+
+    static dist_func_t kernel(size_t dim, simd_level level = cpu_simd_level()) {
+        return get_ip(dim, level);
+    }
+};
+
+// scales v to unit length in place, zero vectors are left alone
+inline void normalize_vector(float *v, size_t dim) {
+    float norm = 0;
+    for (size_t i = 0; i < dim; i++) {
+        norm += v[i] * v[i];
+    }
+    if (norm > 0) {
+        float inv = 1 / std::sqrt(norm);
+        for (size_t i = 0; i < dim; i++) {
+            v[i] *= inv;
+        }
+    }
+}
+
+#endif //UNTITLED_DISTANCE_H
@@ -0,0 +1,336 @@
+#ifndef UNTITLED_EXACT_KNN_H
+#define UNTITLED_EXACT_KNN_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <concepts>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+#include "distance.h"
+#include "parallel.h"
+
+// out[i * stride + j] = <a[i], b[j]> for a block of 4 rows of a by 4 rows of b
+typedef void (*dot_block_func_t)(const float *const *, const float *const *, size_t, float *, size_t);
+
+inline void dot_block_scalar(const float *const *a, const float *const *b, size_t dim, float *out,
+                             size_t stride) {
+    float sum[16] = {};
+    for (size_t i = 0; i < dim; i++) {
+        for (size_t r = 0; r < 4; r++) {
+            for (size_t c = 0; c < 4; c++) {
+                sum[r * 4 + c] += a[r][i] * b[c][i];
+            }
+        }
+    }
+    for (size_t r = 0; r < 4; r++) {
+        for (size_t c = 0; c < 4; c++) {
+            out[r * stride + c] = sum[r * 4 + c];
+        }
+    }
+}
+
+#ifdef HNSW_X86
+
+// [sum(s0), sum(s1), sum(s2), sum(s3)]
+__attribute__((target("avx2,fma")))
+inline __m128 reduce_4_avx2(__m256 s0, __m256 s1, __m256 s2, __m256 s3) {
+    __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+    return _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+}
+
+// 16 ymm registers do not hold 16 accumulators and the 8 rows, so the block is done as two 2 x 4 halves
+// sharing the rows of b, which are in l1 for the second half
+__attribute__((target("avx2,fma")))
+inline void dot_block_avx2(const float *const *a, const float *const *b, size_t dim, float *out, size_t stride) {
+    for (size_t r = 0; r < 4; r += 2) {
+        __m256 s00 = _mm256_setzero_ps(), s01 = _mm256_setzero_ps(), s02 = _mm256_setzero_ps();
+        __m256 s03 = _mm256_setzero_ps(), s10 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps();
+        __m256 s12 = _mm256_setzero_ps(), s13 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= dim; i += 8) {
+            __m256 a0 = _mm256_loadu_ps(a[r] + i);
+            __m256 a1 = _mm256_loadu_ps(a[r + 1] + i);
+            __m256 b0 = _mm256_loadu_ps(b[0] + i);
+            __m256 b1 = _mm256_loadu_ps(b[1] + i);
+            __m256 b2 = _mm256_loadu_ps(b[2] + i);
+            __m256 b3 = _mm256_loadu_ps(b[3] + i);
+            s00 = _mm256_fmadd_ps(a0, b0, s00);
+            s01 = _mm256_fmadd_ps(a0, b1, s01);
+            s02 = _mm256_fmadd_ps(a0, b2, s02);
+            s03 = _mm256_fmadd_ps(a0, b3, s03);
+            s10 = _mm256_fmadd_ps(a1, b0, s10);
+            s11 = _mm256_fmadd_ps(a1, b1, s11);
+            s12 = _mm256_fmadd_ps(a1, b2, s12);
+            s13 = _mm256_fmadd_ps(a1, b3, s13);
+        }
+        __m128 row0 = reduce_4_avx2(s00, s01, s02, s03);
+        __m128 row1 = reduce_4_avx2(s10, s11, s12, s13);
+        _mm_storeu_ps(out + r * stride, row0);
+        _mm_storeu_ps(out + (r + 1) * stride, row1);
+        for (; i < dim; i++) {
+            for (size_t c = 0; c < 4; c++) {
+                out[r * stride + c] += a[r][i] * b[c][i];
+                out[(r + 1) * stride + c] += a[r + 1][i] * b[c][i];
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f,fma")))
+inline void dot_block_avx512(const float *const *a, const float *const *b, size_t dim, float *out,
+                             size_t stride) {
+    __m512 sum[16];
+    for (__m512 &s: sum) {
+        s = _mm512_setzero_ps();
+    }
+    for (size_t i = 0; i < dim; i += 16) {
+        // a full mask except for the tail, where masked loads avoid a scalar loop
+        __mmask16 mask = dim - i >= 16 ? (__mmask16) 0xffff : (__mmask16) ((1u << (dim - i)) - 1);
+        __m512 b0 = _mm512_maskz_loadu_ps(mask, b[0] + i);
+        __m512 b1 = _mm512_maskz_loadu_ps(mask, b[1] + i);
+        __m512 b2 = _mm512_maskz_loadu_ps(mask, b[2] + i);
+        __m512 b3 = _mm512_maskz_loadu_ps(mask, b[3] + i);
+        __m512 a0 = _mm512_maskz_loadu_ps(mask, a[0] + i);
+        __m512 a1 = _mm512_maskz_loadu_ps(mask, a[1] + i);
+        __m512 a2 = _mm512_maskz_loadu_ps(mask, a[2] + i);
+        __m512 a3 = _mm512_maskz_loadu_ps(mask, a[3] + i);
+        sum[0] = _mm512_fmadd_ps(a0, b0, sum[0]);
+        sum[1] = _mm512_fmadd_ps(a0, b1, sum[1]);
+        sum[2] = _mm512_fmadd_ps(a0, b2, sum[2]);
+        sum[3] = _mm512_fmadd_ps(a0, b3, sum[3]);
+        sum[4] = _mm512_fmadd_ps(a1, b0, sum[4]);
+        sum[5] = _mm512_fmadd_ps(a1, b1, sum[5]);
+        sum[6] = _mm512_fmadd_ps(a1, b2, sum[6]);
+        sum[7] = _mm512_fmadd_ps(a1, b3, sum[7]);
+        sum[8] = _mm512_fmadd_ps(a2, b0, sum[8]);
+        sum[9] = _mm512_fmadd_ps(a2, b1, sum[9]);
+        sum[10] = _mm512_fmadd_ps(a2, b2, sum[10]);
+        sum[11] = _mm512_fmadd_ps(a2, b3, sum[11]);
+        sum[12] = _mm512_fmadd_ps(a3, b0, sum[12]);
+        sum[13] = _mm512_fmadd_ps(a3, b1, sum[13]);
+        sum[14] = _mm512_fmadd_ps(a3, b2, sum[14]);
+        sum[15] = _mm512_fmadd_ps(a3, b3, sum[15]);
+    }
+    // halves are added first, then a row of 4 sums is reduced at once as in the avx2 block
+    for (size_t r = 0; r < 4; r++) {
+        __m256 half[4];
+        for (size_t c = 0; c < 4; c++) {
+            __m512 v = sum[r * 4 + c];
+            half[c] = _mm256_add_ps(_mm512_castps512_ps256(v),
+                                    _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+        }
+        _mm_storeu_ps(out + r * stride, reduce_4_avx2(half[0], half[1], half[2], half[3]));
+    }
+}
+
+#endif
+
+#ifdef HNSW_NEON
+
+inline void dot_block_neon(const float *const *a, const float *const *b, size_t dim, float *out, size_t stride) {
+    float32x4_t sum[16];
+    for (float32x4_t &s: sum) {
+        s = vdupq_n_f32(0);
+    }
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        float32x4_t b0 = vld1q_f32(b[0] + i);
+        float32x4_t b1 = vld1q_f32(b[1] + i);
+        float32x4_t b2 = vld1q_f32(b[2] + i);
+        float32x4_t b3 = vld1q_f32(b[3] + i);
+        for (size_t r = 0; r < 4; r++) {
+            float32x4_t ar = vld1q_f32(a[r] + i);
+            sum[r * 4] = vfmaq_f32(sum[r * 4], ar, b0);
+            sum[r * 4 + 1] = vfmaq_f32(sum[r * 4 + 1], ar, b1);
+            sum[r * 4 + 2] = vfmaq_f32(sum[r * 4 + 2], ar, b2);
+            sum[r * 4 + 3] = vfmaq_f32(sum[r * 4 + 3], ar, b3);
+        }
+    }
+    for (size_t r = 0; r < 4; r++) {
+        for (size_t c = 0; c < 4; c++) {
+            float dot = vaddvq_f32(sum[r * 4 + c]);
+            for (size_t j = i; j < dim; j++) {
+                dot += a[r][j] * b[c][j];
+            }
+            out[r * stride + c] = dot;
+        }
+    }
+}
+
+#endif
+
+// levels below avx2 use the scalar block
+inline dot_block_func_t get_dot_block(simd_level level = cpu_simd_level()) {
+    switch (level) {
+#ifdef HNSW_X86
+        case simd_level::avx512:
+            return dot_block_avx512;
+        case simd_level::avx2:
+            return dot_block_avx2;
+#endif
+#ifdef HNSW_NEON
+        case simd_level::neon:
+            return dot_block_neon;
+#endif
+        default:
+            return dot_block_scalar;
+    }
+}
+
+// k nearest base rows of each of n queries, the row of query i at ids[i * k] and distances[i * k], nearest
+// first. ids are base row numbers; when the base has fewer than k rows the row is padded with -1 and an
+// infinite distance, so that it can be written as an .ivecs file as is.
+struct exact_knn_result {
+    size_t n = 0;
+    size_t k = 0;
+    std::vector<int32_t> ids;
+    std::vector<float> distances;
+};
+
+// exact k-nn of every query against every base row, for ground truth and small data sets. base and queries are
+// row sources with size(), dim() and read_row(i, float *out); sources whose operator[] gives float rows (e.g.
+// vecs_data<float>) are read in place, the others are converted tile by tile.
+//
+// the distance is expanded as ||q||^2 + ||b||^2 - 2 <q, b> for l2 and computed from <q, b> for the inner
+// product metrics, so all the work is dot products: QUERY_TILE queries by BASE_TILE base rows at a time, a
+// tile of base rows staying in l2 while every query of the tile is scored against it in 4 x 4 register blocks.
+// query tiles run in parallel on num_threads threads (0 = all cores). the candidates of a query below its
+// current k-th distance are appended to a buffer that is cut back to the k best with nth_element whenever it
+// holds 2k, which costs far less than a heap update per candidate. distances are the ones of Metric, but
+// rounded differently than the index kernels compute them.
+template<typename Metric, typename Base, typename Queries>
+exact_knn_result exact_knn(const Base &base, const Queries &queries, size_t k, size_t num_threads = 0) {
+    const size_t QUERY_TILE = 64;                 // 64 sift queries take 32 kB
+    const size_t BASE_TILE = 256;                 // 256 sift rows take 128 kB
+    const size_t dim = base.dim();
+    const size_t nb = base.size();
+    const size_t nq = queries.size();
+    if (nq > 0 && queries.dim() != dim) {
+        throw std::runtime_error("exact_knn: queries of dimension " + std::to_string(queries.dim()) +
+                                 " against a base of dimension " + std::to_string(dim));
+    }
+    exact_knn_result result;
+    result.n = nq;
+    result.k = k;
+    result.ids.assign(nq * k, -1);
+    result.distances.assign(nq * k, std::numeric_limits<float>::infinity());
+    if (nq == 0 || k == 0) {
+        return result;
+    }
+    const dot_block_func_t dot_block = get_dot_block();
+
+    // points the first rows of rows at rows [begin, end) of source, in place or converted into buffer.
+    // the pointer list is padded to a multiple of 4 by repeating the last row, the padding is scored and ignored.
+    auto tile_rows = [dim](const auto &source, size_t begin, size_t end, std::vector<float> &buffer,
+                           std::vector<const float *> &rows) {
+        size_t count = end - begin;
+        rows.resize((count + 3) / 4 * 4);
+        if constexpr (requires { { source[begin] } -> std::convertible_to<const float *>; }) {
+            for (size_t i = 0; i < count; i++) {
+                rows[i] = source[begin + i];
+            }
+        } else {
+            buffer.resize(count * dim);
+            for (size_t i = 0; i < count; i++) {
+                source.read_row(begin + i, buffer.data() + i * dim);
+                rows[i] = buffer.data() + i * dim;
+            }
+        }
+        std::fill(rows.begin() + count, rows.end(), rows[count - 1]);
+    };
+
+    std::vector<float> base_norms(nb);
+    if constexpr (!std::is_same_v<Metric, metric_ip>) {
+        parallel_for(0, (nb + BASE_TILE - 1) / BASE_TILE, num_threads, [&](size_t t, size_t) {
+            std::vector<float> buffer;
+            std::vector<const float *> rows;
+            size_t begin = t * BASE_TILE, end = std::min(nb, begin + BASE_TILE);
+            tile_rows(base, begin, end, buffer, rows);
+            for (size_t i = begin; i < end; i++) {
+                float norm = 0;
+                for (size_t j = 0; j < dim; j++) {
+                    norm += rows[i - begin][j] * rows[i - begin][j];
+                }
+                base_norms[i] = norm;
+            }
+        });
+    }
+
+    parallel_for(0, (nq + QUERY_TILE - 1) / QUERY_TILE, num_threads, [&](size_t t, size_t) {
+        size_t q_begin = t * QUERY_TILE, q_count = std::min(nq, q_begin + QUERY_TILE) - q_begin;
+        std::vector<float> query_buffer, base_buffer;
+        std::vector<const float *> query_rows, base_rows;
+        tile_rows(queries, q_begin, q_begin + q_count, query_buffer, query_rows);
+        std::vector<float> query_norms(q_count);
+        for (size_t i = 0; i < q_count; i++) {
+            for (size_t j = 0; j < dim; j++) {
+                query_norms[i] += query_rows[i][j] * query_rows[i][j];
+            }
+        }
+        std::vector<std::vector<std::pair<float, int32_t> > > candidates(q_count);
+        std::vector<float> bound(q_count, std::numeric_limits<float>::infinity());
+        std::vector<float> dots(query_rows.size() * BASE_TILE);
+
+        for (size_t b_begin = 0; b_begin < nb; b_begin += BASE_TILE) {
+            size_t b_count = std::min(nb, b_begin + BASE_TILE) - b_begin;
+            tile_rows(base, b_begin, b_begin + b_count, base_buffer, base_rows);
+            // 4 base rows stay in l1 while the query tile streams past them
+            for (size_t bj = 0; bj < base_rows.size(); bj += 4) {
+                for (size_t qi = 0; qi < query_rows.size(); qi += 4) {
+                    dot_block(query_rows.data() + qi, base_rows.data() + bj, dim, dots.data() + qi * BASE_TILE + bj,
+                              BASE_TILE);
+                }
+            }
+
+            for (size_t qi = 0; qi < q_count; qi++) {
+                // the dot products of the row are turned into distances in place, a loop the compiler vectorizes
+                float *row = dots.data() + qi * BASE_TILE;
+                const float *norms = base_norms.data() + b_begin;
+                const float query_norm = query_norms[qi];
+                for (size_t bj = 0; bj < b_count; bj++) {
+                    if constexpr (std::is_same_v<Metric, metric_l2>) {
+                        row[bj] = std::max(query_norm + norms[bj] - 2 * row[bj], 0.0f);
+                    } else if constexpr (Metric::normalize) {
+                        // zero vectors are left as they are by normalize_vector, so they are at distance 1
+                        float both = query_norm * norms[bj];
+                        row[bj] = 1 - (both > 0 ? row[bj] / std::sqrt(both) : 0);
+                    } else {
+                        row[bj] = 1 - row[bj];
+                    }
+                }
+
+                std::vector<std::pair<float, int32_t> > &kept = candidates[qi];
+                for (size_t bj = 0; bj < b_count; bj++) {
+                    float d = row[bj];
+                    if (d >= bound[qi]) {
+                        continue;
+                    }
+                    // base rows come in increasing order, so a later row at the bound never beats the kept one
+                    kept.emplace_back(d, (int32_t) (b_begin + bj));
+                    if (kept.size() == 2 * k) {
+                        std::nth_element(kept.begin(), kept.begin() + (k - 1), kept.end());
+                        kept.resize(k);
+                        bound[qi] = kept[k - 1].first;
+                    }
+                }
+            }
+        }
+
+        for (size_t qi = 0; qi < q_count; qi++) {
+            std::vector<std::pair<float, int32_t> > &kept = candidates[qi];
+            std::sort(kept.begin(), kept.end());
+            kept.resize(std::min(kept.size(), k));
+            for (size_t j = 0; j < kept.size(); j++) {
+                result.distances[(q_begin + qi) * k + j] = kept[j].first;
+                result.ids[(q_begin + qi) * k + j] = kept[j].second;
+            }
+        }
+    });
+    return result;
+}
+
+#endif //UNTITLED_EXACT_KNN_H
@@ -0,0 +1,62 @@
+#ifndef UNTITLED_FILTER_H
+#define UNTITLED_FILTER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// filters for knn_search_filtered. a filter is anything callable as bool(label), label being the external label
+// of a point, so a filter keeps its meaning when repair renumbers the internal ids.
+
+// accepts every point, the search compiles without any filtering for it
+struct accept_all {
+    bool operator()(uint64_t) const {
+        return true;
+    }
+};
+
+// allow-list of labels as one bit per label. count() is kept up to date, so the search knows the selectivity
+// without sampling.
+class filter_bitset {
+private:
+    std::vector<uint64_t> words;
+    size_t bits = 0;
+    size_t members = 0;
+
+public:
+    filter_bitset() = default;
+
+    // labels [0, n) may be set, all start cleared
+    explicit filter_bitset(size_t n) : words((n + 63) / 64, 0), bits(n) {}
+
+    void set(uint64_t label) {
+        uint64_t mask = 1ULL << (label % 64);
+        if (!(words[label / 64] & mask)) {
+            words[label / 64] |= mask;
+            members++;
+        }
+    }
+
+    void reset(uint64_t label) {
+        uint64_t mask = 1ULL << (label % 64);
+        if (words[label / 64] & mask) {
+            words[label / 64] &= ~mask;
+            members--;
+        }
+    }
+
+    // labels past the end are not in the set
+    bool operator()(uint64_t label) const {
+        return label < bits && (words[label / 64] >> (label % 64) & 1);
+    }
+
+    size_t count() const {
+        return members;
+    }
+
+    size_t size() const {
+        return bits;
+    }
+};
+
+#endif //UNTITLED_FILTER_H
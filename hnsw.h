@@ -0,0 +1,2666 @@
+#ifndef UNTITLED_HNSW_H
+#define UNTITLED_HNSW_H
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
+#include <utility>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+#include <fstream>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <chrono>
+#include <numeric>
+#include <functional>
+#include "distance.h"
+#include "quantization.h"
+#include "pq.h"
+#include "dataset.h"
+#include "parallel.h"
+#include "mapped_file.h"
+#include "reserved_memory.h"
+#include "filter.h"
+#include "exact_knn.h"
+#include "diagnostics.h"
+#include "query_profile.h"
+
+struct aligned_free {
+    void operator()(void *p) const {
+        std::free(p);
+    }
+};
+
+template<typename T>
+std::unique_ptr<T[], aligned_free> aligned_array(size_t count, size_t alignment = 64) {
+    size_t bytes = (count * sizeof(T) + alignment - 1) / alignment * alignment;
+    void *p = std::aligned_alloc(alignment, bytes == 0 ? alignment : bytes);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memset(p, 0, bytes);
+    return std::unique_ptr<T[], aligned_free>(static_cast<T *>(p));
+}
+
+// 64-bit hash of a byte range, eight bytes per step so that checking a multi-GB index file stays cheap
+inline uint64_t checksum64(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// on-disk index layout: this header, then the sections below, each starting at a 64-byte aligned offset
+// so that a memory-mapped file can be searched in place. all values are in native byte order.
+struct hnsw_file_header {
+    static constexpr char MAGIC[8] = {'H', 'N', 'S', 'W', 'I', 'D', 'X', '\0'};
+    static constexpr uint32_t VERSION = 4;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    enum section {
+        VECTORS, LINKS0, LINKS_UPPER, LINKS_UPPER_OFFSETS, LEVELS, LABELS, DELETED, SECTION_COUNT
+    };
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t header_size;
+    uint64_t file_size;
+
+    // graph
+    uint64_t dim;
+    uint64_t element_count;
+    uint64_t links_upper_size;                    // number of uint32 in the upper link section
+    uint32_t enter_point;
+    int32_t max_level;
+
+    // hyper parameters
+    int32_t m;
+    int32_t m_max;
+    int32_t m_max_0;
+    int32_t ef_construction;
+    float ml;
+    uint32_t metric;                              // id of the metric the index is specialized on
+    char select_neighbors_mode[20];
+    uint64_t next_label;                          // labels below it were handed out, some may be deleted
+
+    uint64_t section_offset[SECTION_COUNT];
+    uint64_t section_size[SECTION_COUNT];         // bytes
+    uint64_t payload_checksum;                    // over every section, in order
+    uint64_t header_checksum;                     // over the header up to this field
+};
+
+// external label of a point, stable for the lifetime of the point whatever its internal id
+typedef uint64_t label_t;
+
+// one neighbor found by a search, distance is the distance of the index metric used for ranking
+struct search_result {
+    label_t label;
+    float distance;
+};
+
+// set of internal ids cleared in O(1): an id is in the set when its tag equals the current epoch, so a new
+// search only bumps the epoch. the tags are wiped once every 65535 resets when the counter wraps.
+class visited_list {
+private:
+    std::vector<uint16_t> tags;
+    uint16_t epoch = 0;
+
+public:
+    void reset(size_t size) {
+        if (tags.size() < size) {
+            tags.resize(size, 0);
+        }
+        epoch++;
+        if (epoch == 0) {
+            std::fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    bool contains(uint32_t id) const {
+        return tags[id] == epoch;
+    }
+
+    void prefetch(uint32_t id) const {
+        __builtin_prefetch(tags.data() + id, 0, 3);
+    }
+
+    void insert(uint32_t id) {
+        tags[id] = epoch;
+    }
+};
+
+// traversal statistics, collected per search_context and folded into the index by HNSW::merge_stats
+struct search_stats {
+    unsigned long long int distance_calculation_count = 0;
+    unsigned long long int hops = 0;               // nodes whose links were scanned
+    unsigned long long int visited = 0;            // nodes whose distance was taken
+    unsigned long long int queries = 0;
+    unsigned long long int scans = 0;              // filtered queries answered by a scan instead of the graph
+    unsigned long long int heap_operations = 0;    // pushes and pops of the search heaps
+
+    void add(const search_stats &other) {
+        distance_calculation_count += other.distance_calculation_count;
+        hops += other.hops;
+        visited += other.visited;
+        heap_operations += other.heap_operations;
+        queries += other.queries;
+        scans += other.scans;
+    }
+};
+
+// row source over in-memory vectors, the same interface build_graph reads from a vecs_data
+struct nested_rows {
+    const std::vector<std::vector<float> > &rows;
+
+    size_t size() const {
+        return rows.size();
+    }
+
+    size_t dim() const {
+        return rows.empty() ? 0 : rows[0].size();
+    }
+
+    void read_row(size_t i, float *out) const {
+        std::copy(rows[i].begin(), rows[i].end(), out);
+    }
+};
+
+// early termination of the layer 0 search: it stops once patience expansions in a row left the k nearest found
+// unchanged, see basic_hnsw::knn_search_adaptive. patience 0 searches until the ef nearest are final.
+struct stop_rule {
+    int k = 0;
+    int patience = 0;
+};
+
+// per-thread scratch state of an insert or a query, so that several can run at the same time.
+// buffers keep their capacity between calls, one context must not be shared by two threads.
+struct search_context {
+    std::vector<std::pair<float, uint32_t> > candidates;   // min heap (negated distances) of nodes to expand
+    std::vector<std::pair<float, uint32_t> > w;            // max heap of the ef nearest, sorted after the search
+    visited_list visited;                 // nodes seen by search_layer
+    std::vector<uint32_t> links;          // copy of the link block being scanned
+    std::vector<float> nearest;           // max heap of the k nearest distances while a stop_rule is applied
+    std::vector<float> query_table;       // pq distances of the current query to every centroid
+    std::vector<float> query;             // normalized copy of the query for metrics that need one
+
+    // neighbor selection of an insert or a repair, candidates and neighbors as (distance to the base point, id)
+    std::vector<std::pair<float, uint32_t> > pruned;      // candidates the heuristic dropped, nearest first
+    std::vector<std::pair<float, uint32_t> > chosen;      // neighbors selected for the inserted point
+    std::vector<std::pair<float, uint32_t> > overflowed;  // its neighbors whose lists are full
+    std::vector<std::pair<float, uint32_t> > shrink_candidates;   // links of an overflowed neighbor and the point,
+                                                                  // or the candidates of a repaired point
+    std::vector<std::pair<float, uint32_t> > shrunk;      // links kept for an overflowed neighbor or a repaired point
+
+    // edge tracing, only while the index traces
+    bool record_parents = false;
+    std::vector<uint32_t> parents;        // node we came from during the last search_layer
+
+    search_stats stats;
+    query_profile profile;                // per-query profile, only while the index profiles
+};
+
+// the index is specialized on a metric from distance.h (metric_l2, metric_ip, metric_cosine), which picks the
+// distance kernel once per index and decides whether vectors are normalized. HNSW is the l2 index.
+template<typename Metric>
+class basic_hnsw {
+private:
+    // graph
+    // every point is addressed by a 32-bit internal id. vectors live in one aligned arena of
+    // capacity * dim floats, layer 0 links in fixed-stride blocks of [count, m_max_0 slots] and
+    // links of the upper layers in one flat array holding a [count, m_max slots] block per layer above 0
+    // for every node, starting at links_upper_offsets[id].
+    // the arrays point either into buffers owned by the index or into a memory-mapped index file.
+    size_t dim = 0;
+    size_t capacity = 0;
+    // searches running next to add read the count without growth_lock: add publishes a point by storing
+    // the count with release once the point is written, searches load it with acquire
+    std::atomic<size_t> element_count{0};
+    float *vectors = nullptr;
+    uint32_t *links0 = nullptr;
+    uint32_t *links_upper = nullptr;
+    uint64_t *links_upper_offsets = nullptr;
+    size_t links_upper_size = 0;
+    int *levels = nullptr;
+    label_t *labels = nullptr;                    // internal id -> external label
+    uint8_t *deleted = nullptr;                   // tombstones: 1 for points removed by mark_deleted
+    size_t deleted_count = 0;
+    std::unordered_map<label_t, uint32_t> label_lookup;  // external label -> internal id
+    std::atomic<uint32_t> enter_point{0};
+    std::vector<std::unique_ptr<char[], aligned_free> > buffers;
+    std::unique_ptr<mapped_file> mapping;
+
+    // growth
+    // the arrays indexed by internal id live in reserved_memory regions with address space for
+    // reserved_capacity points, of which capacity are committed. add commits more chunk by chunk, so no array
+    // moves while other threads search. the arrays of a loaded index stay in the file until the first add or
+    // reserve moves them into regions.
+    struct point_region {
+        std::unique_ptr<reserved_memory> memory;
+        size_t point_bytes;                       // bytes per point, 0 for the upper links
+    };
+    size_t reserved_capacity = 0;
+    std::vector<point_region> regions;
+    bool arrays_in_file = false;
+    label_t next_label = 0;                       // label of the next point added, never handed out twice
+    std::mutex growth_lock;                       // serializes adds taking ids and growing the arrays
+
+    // compressed storage
+    // with a storage other than fp32 every vector also has a code_size byte code in codes and searches
+    // traverse the graph on the codes. the fp32 vectors stay around for inserts and the exact re-rank
+    // until release_vectors is called.
+    storage_type storage = storage_type::fp32;
+    uint8_t *codes = nullptr;
+    size_t code_bytes = 0;
+    float *code_params = nullptr;                 // decoder parameters, see code_dist_func_t
+    code_dist_func_t code_l2_sqr = nullptr;
+    product_quantizer pq;                         // codebooks of the pq storage
+    bool rerank = true;                           // re-rank the ef candidates of layer 0 with fp32 distances
+    vecs_data<float> rerank_source;               // fp32 rows by label used to re-rank once vectors are released
+
+    // concurrency
+    // link blocks are guarded by striped locks, the enter point by a global lock that an insert keeps
+    // only when it raises the top level. locks are only taken while building or adding with more than one
+    // thread, or always once set_concurrent_updates lets adds run next to searches.
+    size_t num_threads = 1;
+    bool concurrent_build = false;
+    bool concurrent_updates = false;
+    mutable std::vector<std::mutex> link_locks;
+    std::mutex enter_point_lock;
+    std::mutex progress_lock;
+    std::mutex stats_lock;
+    search_context query_context;                 // used by the single-threaded knn_search overload
+    std::vector<search_context> batch_contexts;   // one per thread, used by the knn_search_batch overload
+    std::mutex context_pool_lock;
+    std::vector<std::unique_ptr<search_context> > context_pool;   // idle contexts reused by add
+    // distances of the links to their node while build_graph runs, laid out like the link blocks: entry j + 1
+    // of a block is the distance of link j. shrinking a full list then computes no distance to its links.
+    // written under the link locks with the links, released when the build ends, later adds recompute them.
+    std::vector<float> link_distances0;
+    std::vector<float> link_distances_upper;
+
+    // hyper parameters
+    int m;                                   // number of neighbors to connect in algo1
+    int m_max;                               // limit maximum number of neighbors in algo1
+    int m_max_0;                             // limit maximum number of neighbors at layer0 in algo1
+    int ef_construction;                     // size of dynamic candidate list
+    float ml;                                // normalization factor for level generation
+    std::string select_neighbors_mode;       // select which select neighbor algorithm to use
+
+    // statistics
+    // edge tracing counters, laid out like the link blocks and indexed by (node, link slot) for the first
+    // trace_points nodes: counter j + 1 of a block counts the searches that went through link slot j, counter 0
+    // the searches that stayed on the node. incremented with relaxed atomics by concurrent queries.
+    bool tracing = false;
+    size_t trace_points = 0;
+    mutable std::vector<uint32_t> trace0;
+    mutable std::vector<uint32_t> trace_upper;
+    // query profiling: knn_search times every query and counts its work per layer into its context, the
+    // profiles of the contexts are folded into this one by merge_stats
+    bool profiling = false;
+    query_profile profile;
+    // stopping rule of knn_search_adaptive, set by calibrate_adaptive or set_adaptive_search
+    int adaptive_patience = 0;
+    int adaptive_ef = 0;
+    unsigned long long int distance_calculation_count;           // count number of calling distance function
+    int level_one_hit_count;
+
+    dist_func_t dist_kernel = nullptr;                           // simd kernel of the metric picked for dim
+
+    search_stats stats;
+
+    float dist(search_context &ctx, const float *v1, const float *v2) const {
+        ctx.stats.distance_calculation_count++;
+        return dist_kernel(v1, v2, dim);
+    }
+
+    // distance from the query to a stored point, on the codes when the index is compressed
+    float dist_to_query(search_context &ctx, uint32_t id, const float *q) const {
+        ctx.stats.distance_calculation_count++;
+        if (storage == storage_type::pq) {
+            return pq.distance(ctx.query_table.data(), codes + id * code_bytes);
+        }
+        if (storage != storage_type::fp32) {
+            return code_l2_sqr(q, codes + id * code_bytes, code_params, dim);
+        }
+        return dist_kernel(get_vector(id), q, dim);
+    }
+
+    // next_label only grows: compact and permute drop or move points, the labels they had stay retired
+    void rebuild_label_lookup() {
+        label_lookup.clear();
+        label_lookup.reserve(element_count);
+        for (uint32_t i = 0; i < element_count; i++) {
+            label_lookup[labels[i]] = i;
+            next_label = std::max(next_label, labels[i] + 1);
+        }
+    }
+
+    uint32_t find_label(label_t label) const {
+        auto it = label_lookup.find(label);
+        if (it == label_lookup.end()) {
+            throw std::runtime_error("unknown label " + std::to_string(label));
+        }
+        return it->second;
+    }
+
+    // writes the code of a point whose vector changed
+    void encode_point(uint32_t id) {
+        if (storage == storage_type::int8) {
+            sq8_encode(get_vector(id), dim, code_params, codes + id * code_bytes);
+        } else if (storage == storage_type::fp16) {
+            fp16_encode(get_vector(id), dim, codes + id * code_bytes);
+        } else if (storage == storage_type::pq) {
+            pq.encode(get_vector(id), codes + id * code_bytes);
+        }
+    }
+
+    // replaces the links of a live point at layer lc that lead to deleted points. the live links are kept, the
+    // freed slots go to live neighbors of the deleted neighbors chosen with select_neighbors_heuristic. keeping
+    // the live links keeps the long edges of the point, selecting among all candidates again would only keep
+    // the nearest ones and cut the graph into clusters. only the block of id is written and only blocks of
+    // deleted points are read, so points can be repaired in parallel. the candidates and the selection use the
+    // buffers of ctx like link_back does, so no call allocates once they have grown.
+    void repair_links(search_context &ctx, uint32_t id, int lc) {
+        uint32_t *block = get_links(id, lc);
+        visited_list &seen = ctx.visited;
+        seen.reset(reserved_capacity);
+        seen.insert(id);
+        size_t live = 0;
+        for (uint32_t j = 1; j <= block[0]; j++) {
+            if (!deleted[block[j]]) {
+                seen.insert(block[j]);
+                live++;
+            }
+        }
+        if (live == block[0]) {
+            return;
+        }
+        size_t freed = block[0] - live;
+        std::vector<std::pair<float, uint32_t> > &candidates = ctx.shrink_candidates;
+        candidates.clear();
+        for (uint32_t j = 1; j <= block[0]; j++) {
+            if (!deleted[block[j]]) {
+                continue;
+            }
+            const uint32_t *e_block = get_links(block[j], lc);
+            for (uint32_t k = 1; k <= e_block[0]; k++) {
+                uint32_t e = e_block[k];
+                if (!deleted[e] && !seen.contains(e)) {
+                    seen.insert(e);
+                    candidates.emplace_back(pair_dist(ctx, id, e), e);
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        select_neighbors_heuristic(ctx, id, candidates, freed, false, ctx.shrunk);
+
+        // the live links move to the front of the block, the selection fills the freed slots behind them
+        uint32_t count = 0;
+        for (uint32_t j = 1; j <= block[0]; j++) {
+            if (!deleted[block[j]]) {
+                block[++count] = block[j];
+            }
+        }
+        block[0] = count;
+        for (const std::pair<float, uint32_t> &e: ctx.shrunk) {
+            append_link(id, lc, e.second, e.first);
+        }
+    }
+
+    // moves every point to a new id, order[new id] being its old id, and rewrites the links accordingly.
+    // the arrays are permuted through copies, the upper link blocks keep their total size in the new layout.
+    void permute(const std::vector<uint32_t> &order) {
+        const size_t n = element_count;
+        std::vector<uint32_t> new_id(n);
+        for (uint32_t j = 0; j < n; j++) {
+            new_id[order[j]] = j;
+        }
+        auto permute_array = [&](auto *array, size_t per_point) {
+            if (array == nullptr) {
+                return;
+            }
+            std::vector<std::remove_reference_t<decltype(*array)> > old(array, array + n * per_point);
+            for (size_t j = 0; j < n; j++) {
+                std::copy(old.begin() + order[j] * per_point, old.begin() + (order[j] + 1) * per_point,
+                          array + j * per_point);
+            }
+        };
+        permute_array(vectors, dim);
+        permute_array(codes, code_bytes);
+        permute_array(links0, links0_stride());
+
+        std::vector<uint32_t> old_upper(links_upper, links_upper + links_upper_size);
+        std::vector<uint64_t> old_offsets(links_upper_offsets, links_upper_offsets + n);
+        permute_array(levels, 1);
+        permute_array(labels, 1);
+        permute_array(deleted, 1);
+        uint64_t upper_offset = 0;
+        for (uint32_t j = 0; j < n; j++) {
+            size_t upper = levels[j] * links_upper_stride();
+            std::copy(old_upper.begin() + old_offsets[order[j]], old_upper.begin() + old_offsets[order[j]] + upper,
+                      links_upper + upper_offset);
+            links_upper_offsets[j] = upper_offset;
+            upper_offset += upper;
+            for (int lc = 0; lc <= levels[j]; lc++) {
+                uint32_t *block = get_links(j, lc);
+                for (uint32_t k = 1; k <= block[0]; k++) {
+                    block[k] = new_id[block[k]];
+                }
+            }
+        }
+        enter_point = new_id[enter_point];
+        rebuild_label_lookup();
+        set_tracing(tracing);
+        build_layer_lists();
+    }
+
+    // drops the deleted points and renumbers the others in order. a point only moves to a lower id, so walking
+    // the ids upwards moves every array in place without overwriting data that is still to be read.
+    void compact() {
+        std::vector<uint32_t> new_id(element_count, UINT32_MAX);
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < element_count; i++) {
+            if (!deleted[i]) {
+                new_id[i] = count++;
+            }
+        }
+        uint64_t upper_offset = 0;
+        for (uint32_t i = 0; i < element_count; i++) {
+            if (deleted[i]) {
+                continue;
+            }
+            uint32_t j = new_id[i];
+            for (int lc = 0; lc <= levels[i]; lc++) {
+                uint32_t *block = get_links(i, lc);
+                uint32_t kept = 0;
+                for (uint32_t k = 1; k <= block[0]; k++) {
+                    if (new_id[block[k]] != UINT32_MAX) {
+                        block[1 + kept++] = new_id[block[k]];
+                    }
+                }
+                block[0] = kept;
+            }
+            if (vectors != nullptr) {
+                std::memmove(get_vector(j), get_vector(i), dim * sizeof(float));
+            }
+            if (storage != storage_type::fp32) {
+                std::memmove(codes + j * code_bytes, codes + i * code_bytes, code_bytes);
+            }
+            std::memmove(get_links(j, 0), get_links(i, 0), links0_stride() * sizeof(uint32_t));
+            size_t upper = levels[i] * links_upper_stride();
+            std::memmove(links_upper + upper_offset, links_upper + links_upper_offsets[i], upper * sizeof(uint32_t));
+            links_upper_offsets[j] = upper_offset;
+            upper_offset += upper;
+            levels[j] = levels[i];
+            labels[j] = labels[i];
+        }
+        std::fill(deleted, deleted + element_count, 0);
+        if (count == 0) {
+            // nothing is left: id 0 must not keep the level and links of a dropped point
+            levels[0] = 0;
+            links_upper_offsets[0] = 0;
+            get_links(0, 0)[0] = 0;
+        }
+        enter_point = count == 0 ? 0 : new_id[enter_point];
+        element_count = count;
+        links_upper_size = upper_offset;
+        deleted_count = 0;
+        rebuild_label_lookup();
+        set_tracing(tracing);
+        build_layer_lists();
+    }
+
+    // keeps the k nearest in the flat max heap, a point not nearer than the current furthest is not pushed
+    static void push_bounded(std::vector<std::pair<float, uint32_t> > &heap, float d, uint32_t id, size_t k) {
+        if (heap.size() < k) {
+            heap.emplace_back(d, id);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (k > 0 && d < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = {d, id};
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    // returns q, or a normalized copy of it in ctx for metrics that compare unit vectors
+    const float *normalize_query(search_context &ctx, const float *q) const {
+        if constexpr (Metric::normalize) {
+            ctx.query.assign(q, q + dim);
+            normalize_vector(ctx.query.data(), dim);
+            return ctx.query.data();
+        }
+        return q;
+    }
+
+    // per-query setup of dist_to_query, builds the pq distance table of q
+    void prepare_query(search_context &ctx, const float *q) const {
+        if (storage == storage_type::pq) {
+            ctx.query_table.resize(pq.table_size());
+            pq.compute_table(q, ctx.query_table.data());
+        }
+    }
+
+    // knn_search restricted to the points accept takes, a predicate on internal ids. only layer 0 is filtered,
+    // the upper layers just lead to a good enter point.
+    template<typename Accept>
+    size_t search_accepting(search_context &ctx, const float *q, int k, int ef, search_result *result,
+                            const Accept &accept, stop_rule stop = stop_rule()) const {
+        if (element_count.load(std::memory_order_acquire) == 0) {
+            return 0;                                       // reserved or emptied, no enter point yet
+        }
+        ctx.record_parents = tracing;
+        if (tracing && ctx.parents.size() < reserved_capacity) {
+            ctx.parents.resize(reserved_capacity);
+        }
+        std::chrono::steady_clock::time_point start;
+        search_stats at_start, before;                      // counters when the query and the layer started
+        if (profiling) {
+            start = std::chrono::steady_clock::now();
+            at_start = before = ctx.stats;
+        }
+        q = normalize_query(ctx, q);
+        prepare_query(ctx, q);
+        uint32_t ep = this->enter_point;                    // get enter point for hnsw
+        int l = levels[ep];                                 // top level for hnsw
+        if (profiling && ctx.profile.layers.size() <= l) {
+            ctx.profile.layers.resize(l + 1);
+        }
+        for (int lc = l; lc > 0; lc--) {
+            search_layer(ctx, q, ep, 1, lc);
+            if (tracing) {
+                record_path(ctx, ctx.w[0].second, ep, lc);
+            }
+            if (profiling) {
+                profile_layer(ctx, lc, before);
+            }
+            ep = ctx.w[0].second;
+        }
+
+        search_layer(ctx, q, ep, ef, 0, accept, stop);
+        if (storage != storage_type::fp32 && rerank && (vectors != nullptr || rerank_source.size() > 0)) {
+            for (std::pair<float, uint32_t> &p: ctx.w) {
+                const float *v = exact_vector(p.second);
+                if (v != nullptr) {
+                    p.first = dist(ctx, v, q);
+                }
+            }
+            std::sort(ctx.w.begin(), ctx.w.end());
+        }
+        if (profiling) {
+            profile_layer(ctx, 0, before);
+        }
+
+        size_t count = std::min(ctx.w.size(), (size_t) k);
+        for (size_t i = 0; i < count; i++) {
+            result[i] = {labels[ctx.w[i].second], ctx.w[i].first};
+            if (tracing) {
+                record_path(ctx, ctx.w[i].second, ep, 0);
+            }
+        }
+        ctx.record_parents = false;
+        ctx.stats.queries++;
+        if (profiling) {
+            profile_query(ctx, start, at_start);
+        }
+        return count; // return K nearest elements from W to q
+    }
+
+    // adds the work done since before to layer lc of the context profile and moves before to now
+    static void profile_layer(search_context &ctx, int lc, search_stats &before) {
+        layer_counters &layer = ctx.profile.layers[lc];
+        layer.hops += ctx.stats.hops - before.hops;
+        layer.distances += ctx.stats.distance_calculation_count - before.distance_calculation_count;
+        layer.visited += ctx.stats.visited - before.visited;
+        layer.heap_operations += ctx.stats.heap_operations - before.heap_operations;
+        before = ctx.stats;
+    }
+
+    // records the latency of the query that started at start and the work it did since at_start
+    static void profile_query(search_context &ctx, std::chrono::steady_clock::time_point start,
+                              const search_stats &at_start) {
+        query_profile &p = ctx.profile;
+        p.latency_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        p.hops.record(ctx.stats.hops - at_start.hops);
+        p.distances.record(ctx.stats.distance_calculation_count - at_start.distance_calculation_count);
+        p.visited.record(ctx.stats.visited - at_start.visited);
+        p.heap_operations.record(ctx.stats.heap_operations - at_start.heap_operations);
+        p.queries++;
+    }
+
+    // exact k nearest neighbors of q among the points accept takes, by scoring all of them
+    template<typename Accept>
+    size_t scan(search_context &ctx, const float *q, int k, search_result *result, const Accept &accept) const {
+        q = normalize_query(ctx, q);
+        prepare_query(ctx, q);
+        std::vector<std::pair<float, uint32_t> > &heap = ctx.w;
+        heap.clear();
+        size_t n = element_count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+            if (!accept(i)) {
+                continue;
+            }
+            push_bounded(heap, vectors != nullptr ? dist(ctx, get_vector(i), q) : dist_to_query(ctx, i, q), i, k);
+        }
+        std::sort_heap(heap.begin(), heap.end());
+        for (size_t i = 0; i < heap.size(); i++) {
+            result[i] = {labels[heap[i].second], heap[i].first};
+        }
+        return heap.size();
+    }
+
+    // fraction of the live points filter accepts, exact for a filter that counts its members and otherwise
+    // measured on an evenly spaced sample of the points
+    template<typename Filter>
+    double estimate_selectivity(const Filter &filter) const {
+        size_t n = element_count.load(std::memory_order_acquire);
+        size_t live = n - deleted_count;
+        if (live == 0) {
+            return 0;
+        }
+        if constexpr (requires { filter.count(); }) {
+            return std::min(1.0, (double) filter.count() / live);
+        }
+        size_t samples = std::min(n, (size_t) 1024);
+        size_t accepted = 0, checked = 0;
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t id = i * n / samples;
+            if (!deleted[id]) {
+                checked++;
+                accepted += filter(labels[id]);
+            }
+        }
+        return checked == 0 ? 0 : (double) accepted / checked;
+    }
+
+    // layer 0 part of range_search: every point within the radius that can be reached is expanded, and so are
+    // the ef nearest points seen outside of it, a margin to cross gaps at the border. points within the
+    // radius are passed to emit(id, distance) as soon as they are scored.
+    template<typename Emit>
+    void range_layer(search_context &ctx, const float *q, uint32_t ep, float radius, int ef, Emit &emit) const {
+        std::vector<std::pair<float, uint32_t> > &candidates = ctx.candidates;
+        std::vector<std::pair<float, uint32_t> > &w = ctx.w;          // max heap of the ef nearest outside
+        visited_list &v = ctx.visited;
+        candidates.clear();
+        w.clear();
+        w.reserve(ef + 1);
+        v.reset(reserved_capacity);
+
+        float lower_bound = std::numeric_limits<float>::max();       // distance of the ef-th nearest outside
+        auto score = [&](uint32_t id) {
+            float d = dist_to_query(ctx, id, q);
+            v.insert(id);
+            ctx.stats.visited++;
+            if (d <= radius) {
+                if (!deleted[id]) {
+                    emit(id, d);
+                }
+            } else if (d < lower_bound) {
+                w.emplace_back(d, id);
+                std::push_heap(w.begin(), w.end());
+                ctx.stats.heap_operations++;
+                if (w.size() > ef) {
+                    std::pop_heap(w.begin(), w.end());
+                    w.pop_back();
+                    ctx.stats.heap_operations++;
+                }
+                if (w.size() == ef) {
+                    lower_bound = w.front().first;
+                }
+            } else {
+                return;
+            }
+            candidates.emplace_back(-d, id);
+            std::push_heap(candidates.begin(), candidates.end());
+            ctx.stats.heap_operations++;
+        };
+        score(ep);
+
+        while (!candidates.empty()) {
+            std::pop_heap(candidates.begin(), candidates.end());
+            uint32_t c = candidates.back().second;
+            float c_dist = -candidates.back().first;
+            candidates.pop_back();
+            ctx.stats.heap_operations++;
+            if (c_dist > radius && c_dist > lower_bound) {
+                break;
+            }
+            ctx.stats.hops++;
+
+            const uint32_t *neighbors;
+            size_t count;
+            if (concurrent_build) {
+                read_links(c, 0, ctx.links);
+                neighbors = ctx.links.data();
+                count = ctx.links.size();
+            } else {
+                const uint32_t *block = get_links(c, 0);
+                neighbors = block + 1;
+                count = block[0];
+            }
+            for (size_t j = 0; j < count; j++) {
+                if (j + 1 < count) {
+                    v.prefetch(neighbors[j + 1]);
+                    prefetch_point(neighbors[j + 1]);
+                }
+                if (!v.contains(neighbors[j])) {
+                    score(neighbors[j]);
+                }
+            }
+        }
+    }
+
+    // one past the largest label in the index, the rows a re-rank source needs
+    label_t label_bound() const {
+        label_t bound = 0;
+        for (uint32_t i = 0; i < element_count; i++) {
+            bound = std::max(bound, labels[i] + 1);
+        }
+        return bound;
+    }
+
+    // exact fp32 vector of a point, from the index or else from the re-rank source, nullptr if neither has it
+    const float *exact_vector(uint32_t id) const {
+        if (vectors != nullptr) {
+            return get_vector(id);
+        }
+        if (labels[id] < rerank_source.size()) {
+            return rerank_source[labels[id]];
+        }
+        return nullptr;
+    }
+
+    // asks the cpu to start loading the data dist_to_query will read for id
+    void prefetch_point(uint32_t id) const {
+        if (storage != storage_type::fp32) {
+            __builtin_prefetch(codes + id * code_bytes, 0, 3);
+        } else {
+            __builtin_prefetch(get_vector(id), 0, 3);
+        }
+    }
+
+    size_t links0_stride() const {
+        return 1 + m_max_0;
+    }
+
+    size_t links_upper_stride() const {
+        return 1 + m_max;
+    }
+
+    template<typename T>
+    T *allocate_array(size_t count) {
+        std::unique_ptr<T[], aligned_free> buffer = aligned_array<T>(count);
+        T *p = buffer.get();
+        buffers.emplace_back(reinterpret_cast<char *>(buffer.release()));
+        return p;
+    }
+
+    // array of per_point values for every point in a new region, reserved for reserved_capacity points and
+    // committed for capacity
+    template<typename T>
+    T *allocate_points(size_t per_point) {
+        size_t point_bytes = per_point * sizeof(T);
+        auto memory = std::make_unique<reserved_memory>(reserved_capacity * point_bytes);
+        memory->commit(capacity * point_bytes);
+        T *p = reinterpret_cast<T *>(memory->data());
+        regions.push_back({std::move(memory), point_bytes});
+        return p;
+    }
+
+    // region for the upper links with used slots committed. levels are geometric with 1 / (e^(1 / ml) - 1)
+    // upper blocks per point on average, four times that are reserved.
+    uint32_t *allocate_upper_region(size_t used) {
+        double mean_blocks = ml > 0 ? 1 / std::expm1(1 / ml) : 0;
+        size_t reservation = (size_t) (reserved_capacity * (4 * mean_blocks + 1)) * links_upper_stride();
+        auto memory = std::make_unique<reserved_memory>(std::max(used, reservation) * sizeof(uint32_t));
+        memory->commit(used * sizeof(uint32_t));
+        uint32_t *p = reinterpret_cast<uint32_t *>(memory->data());
+        regions.push_back({std::move(memory), 0});
+        return p;
+    }
+
+    reserved_memory *region_of(const void *p) const {
+        for (const point_region &r: regions) {
+            if (r.memory->data() == p) {
+                return r.memory.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // releases an array handed out by allocate_array or allocate_points, arrays that point into a mapped
+    // file are left alone
+    void free_array(const void *p) {
+        if (p == nullptr) {
+            return;
+        }
+        for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+            if (it->get() == static_cast<const char *>(p)) {
+                buffers.erase(it);
+                return;
+            }
+        }
+        for (auto it = regions.begin(); it != regions.end(); ++it) {
+            if (it->memory->data() == p) {
+                regions.erase(it);
+                return;
+            }
+        }
+    }
+
+    // commits room for n points in every per-point region
+    void grow(size_t n) {
+        if (n <= capacity) {
+            return;
+        }
+        for (point_region &r: regions) {
+            if (r.point_bytes > 0) {
+                r.memory->commit(n * r.point_bytes);
+            }
+        }
+        capacity = n;
+    }
+
+    // moves every array into new regions with room for max_points points and drops the old storage, the
+    // loaded file included
+    void relocate(size_t max_points) {
+        std::vector<point_region> old_regions = std::move(regions);
+        std::vector<std::unique_ptr<char[], aligned_free> > old_buffers = std::move(buffers);
+        std::unique_ptr<mapped_file> old_mapping = std::move(mapping);
+        regions.clear();
+        buffers.clear();
+        reserved_capacity = std::max(max_points, element_count.load());
+        capacity = element_count;
+        auto move = [&](auto *&array, size_t per_point) {
+            if (array == nullptr) {
+                return;
+            }
+            auto *moved = allocate_points<std::remove_reference_t<decltype(*array)> >(per_point);
+            std::copy(array, array + element_count * per_point, moved);
+            array = moved;
+        };
+        move(vectors, dim);
+        move(links0, links0_stride());
+        move(links_upper_offsets, 1);
+        move(levels, 1);
+        move(labels, 1);
+        move(deleted, 1);
+        move(codes, code_bytes);
+        if (code_params != nullptr) {
+            float *params = allocate_array<float>(2 * dim);
+            std::copy(code_params, code_params + 2 * dim, params);
+            code_params = params;
+        }
+        uint32_t *upper = allocate_upper_region(links_upper_size);
+        std::copy(links_upper, links_upper + links_upper_size, upper);
+        links_upper = upper;
+        arrays_in_file = false;
+    }
+
+    // makes room for n points and upper_size upper link slots, called under growth_lock. the arrays have to
+    // move when the reservation is too small or they are still in a loaded file, which only an add that
+    // runs alone may do.
+    void make_room(size_t n, size_t upper_size) {
+        reserved_memory *upper = region_of(links_upper);
+        if (n > reserved_capacity || arrays_in_file || upper == nullptr ||
+            upper_size * sizeof(uint32_t) > upper->capacity()) {
+            if (concurrent_updates) {
+                throw std::runtime_error("add: no room for " + std::to_string(n) +
+                                         " points, reserve more before adding concurrently");
+            }
+            relocate(std::max({n, 2 * reserved_capacity, (size_t) 1024}));
+            upper = region_of(links_upper);
+        }
+        grow(n);
+        upper->commit(upper_size * sizeof(uint32_t));
+    }
+
+    std::unique_ptr<search_context> acquire_context() {
+        std::unique_lock<std::mutex> lock(context_pool_lock);
+        if (context_pool.empty()) {
+            return std::make_unique<search_context>();
+        }
+        std::unique_ptr<search_context> ctx = std::move(context_pool.back());
+        context_pool.pop_back();
+        return ctx;
+    }
+
+    void release_context(std::unique_ptr<search_context> ctx) {
+        std::unique_lock<std::mutex> lock(context_pool_lock);
+        context_pool.push_back(std::move(ctx));
+    }
+
+    // takes the next id for v and links it into the graph under label. the id and the point data are set up
+    // under growth_lock, the links under the link locks as in a parallel build, so that the point is complete
+    // before any search can reach it.
+    void add_point(search_context &ctx, const float *v, label_t label) {
+        uint32_t id;
+        {
+            std::unique_lock<std::mutex> lock(growth_lock);
+            if (vectors == nullptr) {
+                throw std::runtime_error("add: the fp32 vectors were released");
+            }
+            id = element_count;
+            int level = id == 0 ? 0 : random_level();
+            make_room(element_count + 1, links_upper_size + level * links_upper_stride());
+            std::copy(v, v + dim, get_vector(id));
+            if constexpr (Metric::normalize) {
+                normalize_vector(get_vector(id), dim);
+            }
+            encode_point(id);
+            levels[id] = level;
+            labels[id] = label;
+            deleted[id] = 0;
+            links_upper_offsets[id] = links_upper_size;
+            links_upper_size += level * links_upper_stride();
+            for (int lc = 0; lc <= level; lc++) {
+                get_links(id, lc)[0] = 0;
+                if (graph.size() <= lc) {
+                    graph.emplace_back();
+                }
+                graph[lc].push_back(id);
+            }
+            label_lookup[label] = id;
+            element_count.store(id + 1, std::memory_order_release);
+            if (id == 0) {
+                enter_point = 0;
+                return;
+            }
+        }
+        insert(ctx, id);
+        std::unique_lock<std::mutex> lock(stats_lock);
+        distance_calculation_count += ctx.stats.distance_calculation_count;
+        ctx.stats = search_stats();
+    }
+
+    // room for max_elements points, the reservation of an earlier reserve call is kept when larger
+    void allocate(size_t d, size_t max_elements) {
+        buffers.clear();
+        regions.clear();
+        mapping.reset();
+        graph.clear();
+        dim = d;
+        dist_kernel = Metric::kernel(dim);
+        capacity = max_elements;
+        reserved_capacity = std::max(reserved_capacity, max_elements);
+        arrays_in_file = false;
+        element_count = 0;
+        vectors = allocate_points<float>(dim);
+        links0 = allocate_points<uint32_t>(links0_stride());
+        links_upper_offsets = allocate_points<uint64_t>(1);
+        levels = allocate_points<int>(1);
+        labels = allocate_points<label_t>(1);
+        deleted = allocate_points<uint8_t>(1);
+        deleted_count = 0;
+        label_lookup.clear();
+        next_label = 0;
+        links_upper = nullptr;
+        links_upper_size = 0;
+        reset_storage();
+        rerank_source = vecs_data<float>();
+        set_tracing(false);
+    }
+
+    void reset_storage() {
+        storage = storage_type::fp32;
+        codes = nullptr;
+        code_bytes = 0;
+        code_params = nullptr;
+        code_l2_sqr = nullptr;
+    }
+
+    // lays out the upper link blocks once the levels of the first n nodes are known
+    void allocate_upper_links(size_t n) {
+        links_upper_size = 0;
+        for (size_t i = 0; i < n; i++) {
+            links_upper_offsets[i] = links_upper_size;
+            links_upper_size += levels[i] * links_upper_stride();
+        }
+        links_upper = allocate_upper_region(links_upper_size);
+    }
+
+    float *get_vector(uint32_t id) {
+        return vectors + id * dim;
+    }
+
+    const float *get_vector(uint32_t id) const {
+        return vectors + id * dim;
+    }
+
+    // returns the [count, slots...] link block of a node at layer lc
+    uint32_t *get_links(uint32_t id, int lc) {
+        if (lc == 0) {
+            return links0 + id * links0_stride();
+        }
+        return links_upper + links_upper_offsets[id] + (lc - 1) * links_upper_stride();
+    }
+
+    const uint32_t *get_links(uint32_t id, int lc) const {
+        return const_cast<basic_hnsw *>(this)->get_links(id, lc);
+    }
+
+    std::mutex &link_lock(uint32_t id) const {
+        return link_locks[id & (link_locks.size() - 1)];
+    }
+
+    // copies the link block of id at layer lc into out, under its lock during a concurrent build. the caller
+    // must not own a link lock.
+    void read_links(uint32_t id, int lc, std::vector<uint32_t> &out) const {
+        std::unique_lock<std::mutex> lock(link_lock(id), std::defer_lock);
+        if (concurrent_build) {
+            lock.lock();
+        }
+        const uint32_t *block = get_links(id, lc);
+        out.assign(block + 1, block + 1 + block[0]);
+    }
+
+    int random_level() {
+        return floor(-log((float) rand() / (RAND_MAX + 1.0)) * ml);
+    }
+
+    // sets the links of id at layer lc to neighbors as the selection leaves them, (distance, id)
+    void set_links(uint32_t id, int lc, const std::vector<std::pair<float, uint32_t> > &neighbors) {
+        uint32_t *block = get_links(id, lc);
+        size_t m_effective = lc == 0 ? m_max_0 : m_max;
+        size_t count = std::min(neighbors.size(), m_effective);
+        for (size_t i = 0; i < count; i++) {
+            block[1 + i] = neighbors[i].second;
+        }
+        block[0] = count;
+        if (float *distances = distance_block(id, lc)) {
+            for (size_t i = 0; i < count; i++) {
+                distances[1 + i] = neighbors[i].first;
+            }
+        }
+    }
+
+    // distances of the links of id at layer lc while build_graph runs, nullptr otherwise
+    float *distance_block(uint32_t id, int lc) {
+        if (link_distances0.empty()) {
+            return nullptr;
+        }
+        if (lc == 0) {
+            return link_distances0.data() + id * links0_stride();
+        }
+        return link_distances_upper.data() + links_upper_offsets[id] + (lc - 1) * links_upper_stride();
+    }
+
+    // appends e at distance d to the link block of id, which has a free slot
+    void append_link(uint32_t id, int lc, uint32_t e, float d) {
+        uint32_t *block = get_links(id, lc);
+        block[0]++;
+        block[block[0]] = e;
+        if (float *distances = distance_block(id, lc)) {
+            distances[block[0]] = d;
+        }
+    }
+
+    // distance between two stored points
+    float pair_dist(search_context &ctx, uint32_t a, uint32_t b) const {
+        return dist(ctx, get_vector(a), get_vector(b));
+    }
+
+    // the points of one layer as a row source for exact_knn, read in place
+    struct layer_rows {
+        const basic_hnsw *index;
+        const std::vector<uint32_t> *ids;
+
+        size_t size() const {
+            return ids->size();
+        }
+
+        size_t dim() const {
+            return index->dim;
+        }
+
+        const float *operator[](size_t i) const {
+            return index->get_vector((*ids)[i]);
+        }
+
+        void read_row(size_t i, float *out) const {
+            std::copy((*this)[i], (*this)[i] + index->dim, out);
+        }
+    };
+
+    // labels of the exact k nearest live points of every row of sample, for the calibrations
+    template<typename Rows>
+    std::vector<std::vector<label_t> > sample_truth(const Rows &sample, int k) const {
+        if (vectors == nullptr) {
+            throw std::runtime_error("calibration: the fp32 vectors were released");
+        }
+        std::vector<uint32_t> live;
+        for (uint32_t i = 0; i < element_count; i++) {
+            if (!deleted[i]) {
+                live.push_back(i);
+            }
+        }
+        exact_knn_result knn = exact_knn<Metric>(layer_rows{this, &live}, sample, k, num_threads);
+        std::vector<std::vector<label_t> > truth(sample.size());
+        for (size_t i = 0; i < sample.size(); i++) {
+            for (int j = 0; j < k && knn.ids[i * k + j] >= 0; j++) {
+                truth[i].push_back(labels[live[knn.ids[i * k + j]]]);
+            }
+        }
+        return truth;
+    }
+
+    // mean recall of search(ctx, q, result) over the rows of sample, answered on num_threads threads
+    template<typename Rows, typename Search>
+    double sample_recall(const Rows &sample, const std::vector<std::vector<label_t> > &truth, int k,
+                         const Search &search) const {
+        size_t threads = resolve_num_threads(num_threads);
+        std::vector<search_context> contexts(threads);
+        std::vector<std::vector<float> > rows(threads, std::vector<float>(dim));
+        std::vector<std::vector<search_result> > results(threads, std::vector<search_result>(k));
+        std::vector<double> recalls(sample.size());
+        parallel_for(0, sample.size(), threads, [&](size_t i, size_t thread_id) {
+            sample.read_row(i, rows[thread_id].data());
+            search_result *result = results[thread_id].data();
+            size_t count = search(contexts[thread_id], rows[thread_id].data(), result);
+            size_t hits = 0;
+            for (size_t j = 0; j < count; j++) {
+                hits += std::find(truth[i].begin(), truth[i].end(), result[j].label) != truth[i].end();
+            }
+            recalls[i] = truth[i].empty() ? 1 : (double) hits / truth[i].size();
+        });
+        return sample.size() == 0 ? 1 : std::accumulate(recalls.begin(), recalls.end(), 0.0) / sample.size();
+    }
+
+    // smallest value in [low, high] whose recall reaches target, assuming recall grows with the value.
+    // high when none does.
+    template<typename Recall>
+    static int bisect_recall(int low, int high, double target, const Recall &recall) {
+        while (low < high) {
+            int mid = low + (high - low) / 2;
+            if (recall(mid) >= target) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        return low;
+    }
+
+    // tracing counters of node id at layer lc, nullptr for nodes added after tracing started
+    uint32_t *trace_block(uint32_t id, int lc) const {
+        if (id >= trace_points) {
+            return nullptr;
+        }
+        if (lc == 0) {
+            return trace0.data() + id * links0_stride();
+        }
+        size_t offset = links_upper_offsets[id] + (lc - 1) * links_upper_stride();
+        return offset + links_upper_stride() <= trace_upper.size() ? trace_upper.data() + offset : nullptr;
+    }
+
+    void count_trace(uint32_t id, size_t position, int lc) const {
+        uint32_t *counters = trace_block(id, lc);
+        if (counters != nullptr) {
+            std::atomic_ref<uint32_t>(counters[position]).fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // walks the parent chain from p back to ep and counts every edge on it in the slot it was taken from
+    void record_path(search_context &ctx, uint32_t p, uint32_t ep, int lc) const {
+        if (p == ep) {
+            count_trace(p, 0, lc);
+        }
+        while (p != ep) {
+            uint32_t parent = ctx.parents[p];
+            read_links(parent, lc, ctx.links);
+            auto slot = std::find(ctx.links.begin(), ctx.links.end(), p);
+            if (slot != ctx.links.end()) {
+                count_trace(parent, 1 + (slot - ctx.links.begin()), lc);
+            }
+            p = parent;
+        }
+    }
+
+public:
+    static constexpr double SCAN_FACTOR = 10;    // relative cost of a filtered graph search, see knn_search_filtered
+    static constexpr int ADAPTIVE_EF_FACTOR = 50;  // default cap of the adaptive layer 0 list, in multiples of k
+
+    std::vector<std::vector<uint32_t> > graph;
+
+    // fraction of the links of a node that are among its exact nearest neighbors in the layer, averaged per
+    // layer. the neighbors of the whole layer come from one exact_knn call, which is still quadratic in the
+    // layer size: diagnose samples the same measure.
+    std::vector<float> report_neighbor_connection() {
+        if (vectors == nullptr) {
+            throw std::runtime_error("report_neighbor_connection: the fp32 vectors were released");
+        }
+        std::vector<float> connectiveness;
+        for (int l = 0; l < graph.size(); l++) {
+            float connection_level = 0;
+            size_t k = l == 0 ? m_max_0 : m_max;
+            exact_knn_result knn = exact_knn<Metric>(layer_rows{this, &graph[l]}, layer_rows{this, &graph[l]}, k,
+                                                     num_threads);
+            for (size_t i = 0; i < graph[l].size(); i++) {
+                const uint32_t *block = get_links(graph[l][i], l);
+                std::unordered_set<uint32_t> closest;
+                for (size_t j = 0; j < block[0] && knn.ids[i * k + j] >= 0; j++) {
+                    closest.insert(graph[l][knn.ids[i * k + j]]);
+                }
+                int hit = 0;
+                for (uint32_t i = 1; i <= block[0]; i++) {
+                    if (closest.find(block[i]) != closest.end()) {
+                        hit++;
+                    }
+                }
+                connection_level += closest.empty() ? 0 : (float) hit / closest.size();
+            }
+            connectiveness.push_back(connection_level / graph[l].size());
+        }
+        return connectiveness;
+    }
+
+    // graph health per layer: degree distribution, in-degree skew, nodes unreachable from the enter point and
+    // the link recall of up to samples evenly spaced nodes, whose exact neighbors come from one exact_knn call
+    // against the layer. everything but the sampling is exact and linear in the links; runs on num_threads.
+    graph_diagnostics diagnose(size_t samples = 1000) const {
+        const size_t CHUNK = 4096;
+        auto start = std::chrono::steady_clock::now();
+        graph_diagnostics report;
+        report.elements = element_count - deleted_count;
+        report.deleted = deleted_count;
+        report.enter_point = enter_point;
+        std::vector<uint32_t> in_degree(element_count);
+        std::vector<uint8_t> reached(element_count);
+        std::mutex merge_lock;
+        for (int l = 0; l < graph.size(); l++) {
+            layer_diagnostics layer;
+            layer.level = l;
+            std::vector<uint32_t> live;
+            for (uint32_t id: graph[l]) {
+                if (!deleted[id]) {
+                    live.push_back(id);
+                }
+            }
+            layer.nodes = live.size();
+            if (live.empty()) {
+                report.layers.push_back(layer);
+                continue;
+            }
+
+            // out-degrees, and in-degrees counted with atomic increments
+            std::fill(in_degree.begin(), in_degree.end(), 0);
+            std::vector<uint32_t> degree(live.size());
+            parallel_for(0, (live.size() + CHUNK - 1) / CHUNK, num_threads, [&](size_t c, size_t) {
+                for (size_t i = c * CHUNK; i < std::min(live.size(), (c + 1) * CHUNK); i++) {
+                    const uint32_t *block = get_links(live[i], l);
+                    for (uint32_t j = 1; j <= block[0]; j++) {
+                        if (!deleted[block[j]]) {
+                            degree[i]++;
+                            std::atomic_ref<uint32_t>(in_degree[block[j]]).fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                }
+            });
+            layer.min_degree = *std::min_element(degree.begin(), degree.end());
+            layer.max_degree = *std::max_element(degree.begin(), degree.end());
+            layer.degree_histogram.assign(layer.max_degree + 1, 0);
+            for (uint32_t d: degree) {
+                layer.degree_histogram[d]++;
+                layer.links += d;
+            }
+            layer.mean_degree = (double) layer.links / live.size();
+
+            std::vector<uint32_t> in(live.size());
+            double squares = 0;
+            for (size_t i = 0; i < live.size(); i++) {
+                in[i] = in_degree[live[i]];
+                squares += (double) in[i] * in[i];
+                if (in[i] == 0 && live[i] != enter_point) {
+                    layer.zero_in_degree++;
+                }
+            }
+            double mean = layer.mean_degree;
+            layer.in_degree_cv = mean > 0 ? std::sqrt(std::max(squares / live.size() - mean * mean, 0.0)) / mean : 0;
+            size_t top = std::max(live.size() / 100, (size_t) 1);
+            std::nth_element(in.begin(), in.begin() + (top - 1), in.end(), std::greater<uint32_t>());
+            layer.max_in_degree = *std::max_element(in.begin(), in.begin() + top);
+            size_t top_links = std::accumulate(in.begin(), in.begin() + top, (size_t) 0);
+            layer.top_percent_share = layer.links > 0 ? (double) top_links / layer.links : 0;
+
+            // breadth-first search from the enter point one level at a time, the frontier split in chunks
+            std::fill(reached.begin(), reached.end(), 0);
+            std::vector<uint32_t> frontier{enter_point};
+            reached[enter_point] = 1;
+            size_t reached_live = deleted[enter_point] ? 0 : 1;
+            while (!frontier.empty()) {
+                std::vector<uint32_t> next;
+                parallel_for(0, (frontier.size() + CHUNK - 1) / CHUNK, num_threads, [&](size_t c, size_t) {
+                    std::vector<uint32_t> found;
+                    for (size_t i = c * CHUNK; i < std::min(frontier.size(), (c + 1) * CHUNK); i++) {
+                        const uint32_t *block = get_links(frontier[i], l);
+                        for (uint32_t j = 1; j <= block[0]; j++) {
+                            if (std::atomic_ref<uint8_t>(reached[block[j]]).exchange(1, std::memory_order_relaxed) ==
+                                0) {
+                                found.push_back(block[j]);
+                            }
+                        }
+                    }
+                    std::unique_lock<std::mutex> lock(merge_lock);
+                    next.insert(next.end(), found.begin(), found.end());
+                });
+                for (uint32_t id: next) {
+                    reached_live += !deleted[id];
+                }
+                frontier.swap(next);
+            }
+            layer.unreachable = live.size() - reached_live;
+
+            // link recall of the sampled nodes: their k nearest include themselves, hence the one extra
+            if (vectors != nullptr && samples > 0) {
+                std::vector<uint32_t> sample;
+                for (size_t i = 0; i < std::min(samples, live.size()); i++) {
+                    sample.push_back(live[i * live.size() / std::min(samples, live.size())]);
+                }
+                size_t k = layer.max_degree + 1;
+                exact_knn_result knn = exact_knn<Metric>(layer_rows{this, &live}, layer_rows{this, &sample}, k,
+                                                         num_threads);
+                size_t hits = 0, total = 0;
+                std::vector<uint32_t> nearest;
+                for (size_t i = 0; i < sample.size(); i++) {
+                    const uint32_t *block = get_links(sample[i], l);
+                    std::vector<uint32_t> links;
+                    for (uint32_t j = 1; j <= block[0]; j++) {
+                        if (!deleted[block[j]]) {
+                            links.push_back(block[j]);
+                        }
+                    }
+                    nearest.clear();
+                    for (size_t j = 0; j < k && nearest.size() < links.size() && knn.ids[i * k + j] >= 0; j++) {
+                        if (live[knn.ids[i * k + j]] != sample[i]) {
+                            nearest.push_back(live[knn.ids[i * k + j]]);
+                        }
+                    }
+                    for (uint32_t id: links) {
+                        hits += std::find(nearest.begin(), nearest.end(), id) != nearest.end();
+                    }
+                    total += links.size();
+                }
+                layer.link_recall_samples = sample.size();
+                layer.link_recall = total > 0 ? (double) hits / total : 0;
+            }
+            report.layers.push_back(layer);
+        }
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+    basic_hnsw(int m, int m_max, int m_max_0, int ef_construction, float ml,
+               const std::string &select_neighbors_mode) {
+        srand(42);
+        this->m = m;
+        this->m_max = m_max;
+        this->m_max_0 = m_max_0;
+        this->ef_construction = ef_construction;
+        this->ml = ml;
+        this->select_neighbors_mode = select_neighbors_mode;
+        this->distance_calculation_count = 0;
+        this->level_one_hit_count = 0;
+        this->enter_point = 0;
+        this->link_locks = std::vector<std::mutex>(1 << 16);
+    }
+
+    // number of threads build_graph inserts with, 0 = all cores
+    void set_num_threads(size_t n) {
+        num_threads = n;
+    }
+
+    size_t get_num_threads() const {
+        return num_threads;
+    }
+
+    std::tuple<int, int, int, int, float, std::string> get_graph_parameters() {
+        return std::make_tuple(m, m_max, m_max_0, ef_construction, ml, select_neighbors_mode);
+    }
+
+    unsigned long long int get_distance_calculation_count() const {
+        return distance_calculation_count;
+    }
+
+    search_stats get_search_stats() const {
+        return stats;
+    }
+
+    // folds the statistics of a context into the index totals and resets them.
+    // safe to call from several threads, each with its own context.
+    void merge_stats(search_context &ctx) {
+        std::unique_lock<std::mutex> lock(stats_lock);
+        stats.add(ctx.stats);
+        distance_calculation_count += ctx.stats.distance_calculation_count;
+        ctx.stats = search_stats();
+        if (ctx.profile.queries > 0) {
+            profile.merge(ctx.profile);
+        }
+    }
+
+    // query profiling: while on, knn_search and knn_search_filtered time every query that goes through the
+    // graph and count its hops, distances, visited nodes and heap operations per layer. each thread records
+    // into its own context without locks or atomics, the cost is two clock reads and a few counter copies per
+    // layer; merge_stats folds the context into the index profile. off by default, turning it on or off
+    // clears the index profile. not to be switched while searches run.
+    void set_profiling(bool enabled) {
+        std::unique_lock<std::mutex> lock(stats_lock);
+        profiling = enabled;
+        profile.clear();
+    }
+
+    bool is_profiling() const {
+        return profiling;
+    }
+
+    // copy of the profile merged so far, consistent with concurrent merge_stats calls
+    query_profile get_query_profile() {
+        std::unique_lock<std::mutex> lock(stats_lock);
+        return profile;
+    }
+
+    // edge tracing: while on, knn_search counts for every result the edges of the path that led to it from
+    // the enter point of each layer. off by default, queries then do not pay for it. turning it on starts
+    // from zero counters covering the points in the index; points added later are not traced. not to be
+    // switched while searches run.
+    void set_tracing(bool enabled) {
+        tracing = enabled;
+        trace_points = enabled ? element_count.load() : 0;
+        trace0.assign(enabled ? element_count * links0_stride() : 0, 0);
+        trace_upper.assign(enabled ? links_upper_size : 0, 0);
+    }
+
+    bool is_tracing() const {
+        return tracing;
+    }
+
+    // tracing counters of a node at layer lc, laid out like its link block: [stays, slot 0, slot 1, ...],
+    // stays being the searches whose path ended on the node without leaving it. nullptr when not traced.
+    const uint32_t *edge_counts(uint32_t id, int lc) const {
+        return trace_block(id, lc);
+    }
+
+    // searches that went from one node to another at layer lc, from == to gives the stays of the node
+    uint32_t edge_count(uint32_t from, uint32_t to, int lc) const {
+        const uint32_t *counters = trace_block(from, lc);
+        if (counters == nullptr) {
+            return 0;
+        }
+        if (from == to) {
+            return counters[0];
+        }
+        const uint32_t *block = get_links(from, lc);
+        for (uint32_t j = 1; j <= block[0]; j++) {
+            if (block[j] == to) {
+                return counters[j];
+            }
+        }
+        return 0;
+    }
+
+    int get_level_one_hit_count() const {
+        return level_one_hit_count;
+    }
+
+    void set_distance_calculation_count(unsigned long long int set_count) {
+        distance_calculation_count = set_count;
+    }
+
+    size_t size() const {
+        return element_count.load(std::memory_order_acquire);
+    }
+
+    size_t get_dim() const {
+        return dim;
+    }
+
+    label_t get_label(uint32_t id) const {
+        return labels[id];
+    }
+
+    int get_level(uint32_t id) const {
+        return levels[id];
+    }
+
+    std::vector<uint32_t> get_neighbors(uint32_t id, int lc) const {
+        const uint32_t *block = get_links(id, lc);
+        return std::vector<uint32_t>(block + 1, block + 1 + block[0]);
+    }
+
+    // bytes held by vectors and links, excluding the per-layer node lists used for reporting
+    size_t memory_usage() const {
+        size_t bytes = vector_memory_usage() + capacity * links0_stride() * sizeof(uint32_t);
+        if (storage == storage_type::pq) {
+            bytes += capacity * code_bytes + pq.memory_usage();
+        } else if (storage != storage_type::fp32) {
+            bytes += capacity * code_bytes + 2 * dim * sizeof(float);
+        }
+        bytes += capacity * (sizeof(uint64_t) + sizeof(int) + sizeof(label_t) + sizeof(uint8_t));
+        bytes += links_upper_size * sizeof(uint32_t);
+        return bytes;
+    }
+
+    // bytes held by the fp32 vectors, 0 once they were released
+    size_t vector_memory_usage() const {
+        return vectors == nullptr ? 0 : capacity * dim * sizeof(float);
+    }
+
+    storage_type get_storage() const {
+        return storage;
+    }
+
+    // encodes every vector as fp16 or per-dimension min/max int8 and makes searches traverse the graph on
+    // the codes. the int8 ranges are trained on the vectors in the index. needs the fp32 vectors, so call it
+    // before release_vectors. quantize(storage_type::fp32) goes back to exact traversal.
+    void quantize(storage_type type) {
+        if (vectors == nullptr) {
+            throw std::runtime_error("quantize: the fp32 vectors were released");
+        }
+        if (type == storage_type::pq) {
+            throw std::runtime_error("quantize: pq needs training data, use quantize_pq");
+        }
+        if (!std::is_same_v<Metric, metric_l2> && type != storage_type::fp32) {
+            throw std::runtime_error("quantize: compressed storage supports the l2 metric only");
+        }
+        free_array(codes);
+        free_array(code_params);
+        reset_storage();
+        if (type == storage_type::fp32) {
+            return;
+        }
+        code_bytes = code_size(type, dim);
+        codes = allocate_points<uint8_t>(code_bytes);
+        code_params = allocate_array<float>(2 * dim);
+        if (type == storage_type::int8) {
+            sq8_train(vectors, element_count, dim, code_params);
+        }
+        parallel_for(0, element_count, num_threads, [&](size_t i, size_t) {
+            if (type == storage_type::int8) {
+                sq8_encode(get_vector(i), dim, code_params, codes + i * code_bytes);
+            } else {
+                fp16_encode(get_vector(i), dim, codes + i * code_bytes);
+            }
+        });
+        code_l2_sqr = get_code_l2_sqr(type, dim);
+        storage = type;
+    }
+
+    // encodes every vector as an m byte product quantization code and makes searches traverse the graph with
+    // per-query distance tables. the codebooks are trained on train, any row source with size(), dim() and
+    // read_row(i, float *out), typically a learn set rather than the indexed points.
+    template<typename Source>
+    void quantize_pq(const Source &train, size_t m, int iterations = 25) {
+        if (vectors == nullptr) {
+            throw std::runtime_error("quantize_pq: the fp32 vectors were released");
+        }
+        if (train.dim() != dim) {
+            throw std::runtime_error("quantize_pq: training vectors have another dimension");
+        }
+        if (!std::is_same_v<Metric, metric_l2>) {
+            throw std::runtime_error("quantize_pq: compressed storage supports the l2 metric only");
+        }
+        product_quantizer trained;
+        trained.train(train, m, iterations, 65536, num_threads);
+        free_array(codes);
+        free_array(code_params);
+        reset_storage();
+        pq = std::move(trained);
+        code_bytes = pq.code_size();
+        codes = allocate_points<uint8_t>(code_bytes);
+        parallel_for(0, element_count, num_threads, [&](size_t i, size_t) {
+            pq.encode(get_vector(i), codes + i * code_bytes);
+        });
+        storage = storage_type::pq;
+    }
+
+    // fp32 rows, indexed by label, that the re-rank reads once the vectors of the index were released, e.g. the
+    // memory-mapped base file. only the pages of the final candidates are touched. the source needs a row for
+    // every label in the index, a candidate left with its code distance could not be ranked with the others.
+    void set_rerank_source(const vecs_data<float> &source) {
+        if (source.size() > 0 && source.dim() != dim) {
+            throw std::runtime_error("set_rerank_source: rows have another dimension");
+        }
+        if (source.size() > 0 && source.size() < label_bound()) {
+            throw std::runtime_error("set_rerank_source: fewer rows than labels in the index");
+        }
+        rerank_source = source;
+    }
+
+    // whether knn_search re-ranks the ef candidates of layer 0 with exact fp32 distances on a compressed index
+    void set_rerank(bool enabled) {
+        rerank = enabled;
+    }
+
+    // frees the fp32 vectors of a compressed index, so that only the codes are kept in memory.
+    // searches then return code distances, inserting or saving is no longer possible.
+    void release_vectors() {
+        if (storage == storage_type::fp32) {
+            throw std::runtime_error("release_vectors: the index is not compressed");
+        }
+        if (rerank_source.size() > 0 && rerank_source.size() < label_bound()) {
+            throw std::runtime_error("release_vectors: the re-rank source has fewer rows than labels in the index");
+        }
+        free_array(vectors);
+        vectors = nullptr;
+    }
+
+    // reserves address space for max_points points, so that add grows the index up to there in place, which is
+    // what lets adds run while other threads search. every search context keeps a visited list of max_points
+    // entries, so reserve what the index will hold rather than an arbitrary bound. the arrays are moved once
+    // when they do not fit or still are in a loaded file, so reserve must not run next to anything else.
+    // an empty index needs the dimension d of the points it will hold.
+    void reserve(size_t max_points, size_t d = 0) {
+        if (element_count == 0) {
+            if (d == 0 && dim == 0) {
+                throw std::runtime_error("reserve: the dimension of an empty index is needed");
+            }
+            reserved_capacity = std::max(max_points, (size_t) 1);
+            allocate(d != 0 ? d : dim, 0);
+            allocate_upper_links(0);
+            enter_point = 0;
+            return;
+        }
+        if (d != 0 && d != dim) {
+            throw std::runtime_error("reserve: the index holds points of another dimension");
+        }
+        if (max_points > reserved_capacity || arrays_in_file) {
+            relocate(max_points);
+        }
+    }
+
+    // makes every search and insert take the link locks, so that add and add_batch can run while other
+    // threads search. a search then copies each link block under its lock, which costs some throughput.
+    // must not be switched while anything runs.
+    void set_concurrent_updates(bool enabled) {
+        concurrent_updates = enabled;
+        concurrent_build = enabled;
+    }
+
+    // adds v as a new point and returns its label, which follows every label in the index. the arrays grow in
+    // place within the reservation, see reserve. with set_concurrent_updates(true) any number of threads may
+    // add and search at the same time, otherwise add must run alone.
+    label_t add(const float *v) {
+        if (dim == 0) {
+            throw std::runtime_error("add: the dimension is unknown, build the index or reserve first");
+        }
+        label_t label;
+        {
+            std::unique_lock<std::mutex> lock(growth_lock);
+            label = next_label++;
+        }
+        std::unique_ptr<search_context> ctx = acquire_context();
+        add_point(*ctx, v, label);
+        release_context(std::move(ctx));
+        return label;
+    }
+
+    // adds every row of rows, any row source with size(), dim() and read_row(i, float *out), on num_threads
+    // threads. row i gets the returned label plus i. room for all rows is made up front, so with
+    // set_concurrent_updates(true) searches may run meanwhile as long as the reservation suffices.
+    template<typename Source>
+    label_t add_batch(const Source &rows) {
+        if (dim == 0 && element_count == 0) {
+            reserve(rows.size(), rows.dim());
+        }
+        if (rows.size() > 0 && rows.dim() != dim) {
+            throw std::runtime_error("add_batch: rows have another dimension");
+        }
+        label_t first;
+        {
+            std::unique_lock<std::mutex> lock(growth_lock);
+            make_room(element_count + rows.size(), links_upper_size);
+            first = next_label;
+            next_label += rows.size();
+        }
+
+        size_t threads = resolve_num_threads(num_threads);
+        std::vector<std::unique_ptr<search_context> > contexts;
+        for (size_t t = 0; t < threads; t++) {
+            contexts.push_back(acquire_context());
+        }
+        std::vector<std::vector<float> > rows_read(threads, std::vector<float>(dim));
+        if (!concurrent_updates) {
+            concurrent_build = threads > 1;
+        }
+        try {
+            parallel_for(0, rows.size(), threads, [&](size_t i, size_t thread_id) {
+                rows.read_row(i, rows_read[thread_id].data());
+                add_point(*contexts[thread_id], rows_read[thread_id].data(), first + i);
+            });
+        } catch (...) {
+            if (!concurrent_updates) {
+                concurrent_build = false;
+            }
+            throw;
+        }
+        if (!concurrent_updates) {
+            concurrent_build = false;
+        }
+        for (std::unique_ptr<search_context> &ctx: contexts) {
+            release_context(std::move(ctx));
+        }
+        return first;
+    }
+
+    // removes a point from the results. the point stays in the graph and keeps routing searches until repair
+    // drops it. deleting a deleted point does nothing. not safe while other threads search or insert.
+    void mark_deleted(label_t label) {
+        uint32_t id = find_label(label);
+        if (!deleted[id]) {
+            deleted[id] = 1;
+            deleted_count++;
+        }
+    }
+
+    bool is_deleted(label_t label) const {
+        return deleted[find_label(label)] != 0;
+    }
+
+    // number of points marked deleted and not yet dropped by repair, they are still counted by size()
+    size_t deleted_size() const {
+        return deleted_count;
+    }
+
+    // replaces the vector of a point in place and reconnects it like a new insert at its level. links that
+    // other points have to its old position stay until they are pruned. a deleted point comes back.
+    // not safe while other threads search or insert.
+    void update(label_t label, const float *v) {
+        if (vectors == nullptr) {
+            throw std::runtime_error("update: the fp32 vectors were released");
+        }
+        uint32_t id = find_label(label);
+        std::copy(v, v + dim, get_vector(id));
+        if constexpr (Metric::normalize) {
+            normalize_vector(get_vector(id), dim);
+        }
+        encode_point(id);
+        if (deleted[id]) {
+            deleted[id] = 0;
+            deleted_count--;
+        }
+        if (element_count > 1) {
+            search_context ctx;
+            insert(ctx, id);
+            distance_calculation_count += ctx.stats.distance_calculation_count;
+        }
+    }
+
+    // on-demand repair after deletions: every live point that links to a deleted one gets the freed slots of
+    // that layer refilled from the neighbors of the deleted one (see repair_links), then the deleted points are
+    // dropped and their slots reclaimed. internal ids change, labels do not. returns the number of dropped
+    // points. not safe while other threads search or insert.
+    size_t repair() {
+        if (deleted_count == 0) {
+            return 0;
+        }
+        if (vectors == nullptr) {
+            throw std::runtime_error("repair: the fp32 vectors were released");
+        }
+        size_t threads = resolve_num_threads(num_threads);
+        std::vector<search_context> contexts(threads);
+        parallel_for(0, element_count, threads, [&](size_t i, size_t thread_id) {
+            if (deleted[i]) {
+                return;
+            }
+            for (int lc = 0; lc <= levels[i]; lc++) {
+                repair_links(contexts[thread_id], i, lc);
+            }
+        });
+        for (const search_context &ctx: contexts) {
+            distance_calculation_count += ctx.stats.distance_calculation_count;
+        }
+
+        // the new enter point is the live point with the highest level
+        if (deleted[enter_point]) {
+            for (uint32_t i = 0; i < element_count; i++) {
+                if (!deleted[i] && (deleted[enter_point] || levels[i] > levels[enter_point])) {
+                    enter_point = i;
+                }
+            }
+        }
+        size_t dropped = deleted_count;
+        compact();
+        return dropped;
+    }
+
+    // renumbers the points in breadth-first order of layer 0 from the enter point, so that linked points get
+    // close ids and a search reads vectors and link blocks that share cache lines and pages instead of
+    // jumping across the whole index. points the enter point does not reach follow, each one starting a
+    // breadth-first walk of its own. vectors, codes and link blocks move to the new ids, labels do not
+    // change and neither do search results. not safe while other threads search or insert.
+    void reorder() {
+        std::vector<uint32_t> order;              // order[new id] = old id
+        order.reserve(element_count);
+        std::vector<uint8_t> queued(element_count);
+        for (uint32_t start = enter_point, next_start = 0; order.size() < element_count; start = next_start) {
+            queued[start] = 1;
+            order.push_back(start);
+            for (size_t head = order.size() - 1; head < order.size(); head++) {
+                const uint32_t *block = get_links(order[head], 0);
+                for (uint32_t j = 1; j <= block[0]; j++) {
+                    if (!queued[block[j]]) {
+                        queued[block[j]] = 1;
+                        order.push_back(block[j]);
+                    }
+                }
+            }
+            while (next_start < element_count && queued[next_start]) {
+                next_start++;
+            }
+        }
+        permute(order);
+    }
+
+    // writes the index to path in the versioned binary format described by hnsw_file_header.
+    // a compressed index is written with its fp32 vectors only, quantize it again after loading.
+    void save(const std::string &path) const {
+        if (vectors == nullptr) {
+            throw std::runtime_error("save: the fp32 vectors were released");
+        }
+        hnsw_file_header header{};
+        std::memcpy(header.magic, hnsw_file_header::MAGIC, sizeof(header.magic));
+        header.version = hnsw_file_header::VERSION;
+        header.byte_order = hnsw_file_header::BYTE_ORDER_MARK;
+        header.header_size = sizeof(hnsw_file_header);
+        header.dim = dim;
+        header.element_count = element_count;
+        header.links_upper_size = element_count == 0 ? 0 : links_upper_offsets[element_count - 1] +
+                                                            levels[element_count - 1] * links_upper_stride();
+        header.enter_point = enter_point;
+        header.max_level = element_count == 0 ? 0 : levels[enter_point];
+        header.m = m;
+        header.m_max = m_max;
+        header.m_max_0 = m_max_0;
+        header.ef_construction = ef_construction;
+        header.ml = ml;
+        header.metric = Metric::id;
+        if (select_neighbors_mode.size() >= sizeof(header.select_neighbors_mode)) {
+            throw std::runtime_error("save: select_neighbors_mode is too long");
+        }
+        std::memcpy(header.select_neighbors_mode, select_neighbors_mode.c_str(), select_neighbors_mode.size() + 1);
+        header.next_label = next_label;
+
+        const void *data[hnsw_file_header::SECTION_COUNT] = {vectors, links0, links_upper, links_upper_offsets,
+                                                             levels, labels, deleted};
+        header.section_size[hnsw_file_header::VECTORS] = element_count * dim * sizeof(float);
+        header.section_size[hnsw_file_header::LINKS0] = element_count * links0_stride() * sizeof(uint32_t);
+        header.section_size[hnsw_file_header::LINKS_UPPER] = header.links_upper_size * sizeof(uint32_t);
+        header.section_size[hnsw_file_header::LINKS_UPPER_OFFSETS] = element_count * sizeof(uint64_t);
+        header.section_size[hnsw_file_header::LEVELS] = element_count * sizeof(int);
+        header.section_size[hnsw_file_header::LABELS] = element_count * sizeof(label_t);
+        header.section_size[hnsw_file_header::DELETED] = element_count * sizeof(uint8_t);
+
+        auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+        uint64_t offset = align(sizeof(hnsw_file_header));
+        header.payload_checksum = checksum64(nullptr, 0);
+        for (int i = 0; i < hnsw_file_header::SECTION_COUNT; i++) {
+            header.section_offset[i] = offset;
+            offset = align(offset + header.section_size[i]);
+            header.payload_checksum = checksum64(data[i], header.section_size[i], header.payload_checksum);
+        }
+        header.file_size = offset;
+        header.header_checksum = checksum64(&header, offsetof(hnsw_file_header, header_checksum));
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("save: cannot open " + path);
+        }
+        const char zeros[64] = {};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(hnsw_file_header));
+        uint64_t written = sizeof(hnsw_file_header);
+        for (int i = 0; i < hnsw_file_header::SECTION_COUNT; i++) {
+            out.write(zeros, header.section_offset[i] - written);
+            out.write(static_cast<const char *>(data[i]), header.section_size[i]);
+            written = header.section_offset[i] + header.section_size[i];
+        }
+        out.write(zeros, header.file_size - written);
+        if (!out.good()) {
+            throw std::runtime_error("save: write to " + path + " failed");
+        }
+    }
+
+    // opens an index written by save. with use_mmap the file is mapped and searched in place without
+    // copying anything, otherwise it is read into memory. verify_checksum hashes the whole payload, which
+    // touches every page of a mapped file, so skip it when the index must be available right away.
+    // on any error the index is left unchanged and a runtime_error is thrown.
+    void load(const std::string &path, bool use_mmap = false, bool verify_checksum = true) {
+        std::unique_ptr<mapped_file> file;
+        std::unique_ptr<char[], aligned_free> buffer;
+        char *base;
+        size_t size;
+        if (use_mmap) {
+            file = std::make_unique<mapped_file>(path);
+            file->advise_random();
+            base = file->data();
+            size = file->size();
+        } else {
+            std::ifstream in(path, std::ios::binary | std::ios::ate);
+            if (!in.is_open()) {
+                throw std::runtime_error("load: cannot open " + path);
+            }
+            size = (size_t) in.tellg();
+            buffer = aligned_array<char>(size);
+            in.seekg(0, std::ios::beg);
+            in.read(buffer.get(), size);
+            if (!in.good()) {
+                throw std::runtime_error("load: read from " + path + " failed");
+            }
+            base = buffer.get();
+        }
+
+        hnsw_file_header header{};
+        if (size < sizeof(hnsw_file_header)) {
+            throw std::runtime_error("load: " + path + " is too small to be an index");
+        }
+        std::memcpy(&header, base, sizeof(hnsw_file_header));
+        if (std::memcmp(header.magic, hnsw_file_header::MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("load: " + path + " is not an index file");
+        }
+        if (header.byte_order != hnsw_file_header::BYTE_ORDER_MARK) {
+            throw std::runtime_error("load: " + path + " was written with another byte order");
+        }
+        if (header.version != hnsw_file_header::VERSION || header.header_size != sizeof(hnsw_file_header)) {
+            throw std::runtime_error("load: unsupported index version " + std::to_string(header.version));
+        }
+        if (header.header_checksum != checksum64(&header, offsetof(hnsw_file_header, header_checksum))) {
+            throw std::runtime_error("load: header checksum mismatch in " + path);
+        }
+        if (header.file_size != size) {
+            throw std::runtime_error("load: " + path + " is truncated");
+        }
+        uint64_t n = header.element_count;
+        uint64_t expected_size[hnsw_file_header::SECTION_COUNT] = {
+                n * header.dim * sizeof(float), n * (1 + header.m_max_0) * sizeof(uint32_t),
+                header.links_upper_size * sizeof(uint32_t), n * sizeof(uint64_t), n * sizeof(int),
+                n * sizeof(label_t), n * sizeof(uint8_t)};
+        uint64_t checksum = checksum64(nullptr, 0);
+        for (int i = 0; i < hnsw_file_header::SECTION_COUNT; i++) {
+            if (header.section_size[i] != expected_size[i] || header.section_offset[i] % 64 != 0 ||
+                header.section_offset[i] + header.section_size[i] > size) {
+                throw std::runtime_error("load: corrupt section table in " + path);
+            }
+            if (verify_checksum) {
+                checksum = checksum64(base + header.section_offset[i], header.section_size[i], checksum);
+            }
+        }
+        if (verify_checksum && checksum != header.payload_checksum) {
+            throw std::runtime_error("load: payload checksum mismatch in " + path);
+        }
+        if (header.metric != Metric::id) {
+            throw std::runtime_error("load: " + path + " was built for another metric than " + Metric::name);
+        }
+        if (header.dim == 0 || (n > 0 && header.enter_point >= n) || header.m_max_0 <= 0 || header.m_max <= 0) {
+            throw std::runtime_error("load: invalid graph parameters in " + path);
+        }
+
+        buffers.clear();
+        regions.clear();
+        if (buffer) {
+            buffers.emplace_back(std::move(buffer));
+        }
+        mapping = std::move(file);
+        m = header.m;
+        m_max = header.m_max;
+        m_max_0 = header.m_max_0;
+        ef_construction = header.ef_construction;
+        ml = header.ml;
+        select_neighbors_mode = std::string(header.select_neighbors_mode,
+                                            strnlen(header.select_neighbors_mode,
+                                                    sizeof(header.select_neighbors_mode)));
+        dim = header.dim;
+        dist_kernel = Metric::kernel(dim);
+        reset_storage();
+        rerank_source = vecs_data<float>();
+        capacity = element_count = n;
+        reserved_capacity = n;
+        arrays_in_file = true;
+        vectors = reinterpret_cast<float *>(base + header.section_offset[hnsw_file_header::VECTORS]);
+        links0 = reinterpret_cast<uint32_t *>(base + header.section_offset[hnsw_file_header::LINKS0]);
+        links_upper = reinterpret_cast<uint32_t *>(base + header.section_offset[hnsw_file_header::LINKS_UPPER]);
+        links_upper_offsets = reinterpret_cast<uint64_t *>(
+                base + header.section_offset[hnsw_file_header::LINKS_UPPER_OFFSETS]);
+        links_upper_size = header.links_upper_size;
+        levels = reinterpret_cast<int *>(base + header.section_offset[hnsw_file_header::LEVELS]);
+        labels = reinterpret_cast<label_t *>(base + header.section_offset[hnsw_file_header::LABELS]);
+        deleted = reinterpret_cast<uint8_t *>(base + header.section_offset[hnsw_file_header::DELETED]);
+        deleted_count = std::count(deleted, deleted + n, 1);
+        next_label = header.next_label;
+        rebuild_label_lookup();
+        enter_point = header.enter_point;
+        distance_calculation_count = 0;
+        stats = search_stats();
+        set_tracing(false);
+        build_layer_lists();
+    }
+
+    void print_graph_parameters() {
+        std::cout << "m=" << m << ", m_max=" << m_max << ", m_max_0=" << m_max_0 << ", ef_construction="
+                  << ef_construction << ", ml=" << ml << ", select_neighbor=" << select_neighbors_mode << std::endl;
+    }
+
+    static void log_progress(int curr, int total) {
+        int barWidth = 70;
+        if (total < 100 || curr % (total / 100) != 0) {
+            return;
+        }
+        float progress = (float) curr / total;
+        std::cout << std::flush << "\r";
+        std::cout << "[";
+        int pos = barWidth * progress;
+        for (int i = 0; i < barWidth; ++i) {
+            if (i < pos)
+                std::cout << "=";
+            else if (i == pos)
+                std::cout << ">";
+            else
+                std::cout << " ";
+        }
+        std::cout << "] " << int(progress * 100.0);
+
+        if (curr == total) {
+            std::cout << std::endl;
+        }
+    }
+
+
+    void build_graph(const std::vector<std::vector<float> > &input) {
+        for (const std::vector<float> &v: input) {
+            if (v.size() != input[0].size()) {
+                throw std::runtime_error("build_graph: vectors sizes do not match");
+            }
+        }
+        build_graph(nested_rows{input});
+    }
+
+    // builds from any row source with size(), dim() and read_row(i, float *out), e.g. a mapped vecs_data,
+    // rows are converted straight into the index storage without an intermediate copy
+    template<typename Source>
+    void build_graph(const Source &input) {
+        if (input.size() == 0) {
+            return;
+        }
+        allocate(input.dim(), input.size());
+        std::cout << "building graph" << std::endl;
+
+        // levels are drawn up front in input order, so the graph does not depend on thread scheduling
+        for (int i = 0; i < input.size(); i++) {
+            input.read_row(i, get_vector(i));
+            if constexpr (Metric::normalize) {
+                normalize_vector(get_vector(i), dim);
+            }
+            labels[i] = i;
+            levels[i] = i == 0 ? 0 : random_level();
+        }
+        allocate_upper_links(input.size());
+        element_count = input.size();
+        rebuild_label_lookup();
+
+        // special case: the first node has no enter point to insert
+        enter_point = 0;
+
+        link_distances0.assign(element_count * links0_stride(), 0);
+        link_distances_upper.assign(links_upper_size, 0);
+
+        size_t threads = resolve_num_threads(num_threads);
+        std::vector<search_context> contexts(threads);
+        std::atomic<int> inserted(1);
+        concurrent_build = threads > 1 || concurrent_updates;
+        parallel_for(1, input.size(), threads, [&](size_t i, size_t thread_id) {
+            insert(contexts[thread_id], i);
+            int done = ++inserted;
+            if (concurrent_build) {
+                std::unique_lock<std::mutex> lock(progress_lock);
+                log_progress(done, input.size());
+            } else {
+                log_progress(done, input.size());
+            }
+        });
+        concurrent_build = concurrent_updates;
+        std::vector<float>().swap(link_distances0);
+        std::vector<float>().swap(link_distances_upper);
+        for (const search_context &ctx: contexts) {
+            distance_calculation_count += ctx.stats.distance_calculation_count;
+        }
+
+        build_layer_lists();
+    }
+
+    // add nodes to specific layers of graph
+    void build_layer_lists() {
+        graph.clear();
+        for (uint32_t i = 0; i < element_count; i++) {
+            while (graph.size() <= levels[i]) {
+                graph.emplace_back();
+            }
+            for (int l = 0; l <= levels[i]; l++) {
+                graph[l].push_back(i);
+            }
+        }
+    }
+
+    // links the point q, whose vector, level and link blocks are set up, into the graph with the
+    // hyper parameters of the index
+    void insert(search_context &ctx, uint32_t q) {
+        const float *q_data = get_vector(q);
+        int l_new = levels[q];
+        prepare_query(ctx, q_data);
+
+        // hold the global lock for the whole insert only if q becomes the new enter point
+        std::unique_lock<std::mutex> global_lock(enter_point_lock, std::defer_lock);
+        if (concurrent_build) {
+            global_lock.lock();
+        }
+        uint32_t ep = this->enter_point;
+        int l = levels[ep];
+        if (global_lock.owns_lock() && l_new <= l) {
+            global_lock.unlock();
+        }
+
+        for (int lc = l; lc > l_new; lc--) {
+            search_layer(ctx, q_data, ep, 1, lc);
+            ep = ctx.w[0].second; // ep = nearest element from W to q
+        }
+
+        for (int lc = std::min(l, l_new); lc >= 0; lc--) {
+            search_layer(ctx, q_data, ep, ef_construction, lc);
+            // an existing point reconnected by update finds itself
+            ctx.w.erase(std::remove_if(ctx.w.begin(), ctx.w.end(),
+                                       [q](const std::pair<float, uint32_t> &p) { return p.second == q; }),
+                        ctx.w.end());
+            if (ctx.w.empty()) {
+                continue;
+            }
+            // the search left the candidates sorted with their distance to q, the selection reuses them. on
+            // compressed storage those are code distances, while the selection compares them with exact
+            // distances between points and hands them on to link_back, so they are taken again exactly.
+            if (storage != storage_type::fp32) {
+                for (std::pair<float, uint32_t> &p: ctx.w) {
+                    p.first = pair_dist(ctx, q, p.second);
+                }
+                std::sort(ctx.w.begin(), ctx.w.end());
+            }
+            uint32_t nearest = ctx.w[0].second;
+
+            select_neighbors(ctx, q, ctx.w, m, ctx.chosen);
+
+            // add bidirectional connections from neighbors to q at layer lc
+            {
+                std::unique_lock<std::mutex> lock(link_lock(q), std::defer_lock);
+                if (concurrent_build) {
+                    lock.lock();
+                }
+                set_links(q, lc, ctx.chosen);
+            }
+            link_back(ctx, q, lc);
+            ep = nearest;
+        }
+        if (l_new > l) {
+            this->enter_point = q;
+        }
+    }
+
+    // searches layer lc starting from ep and leaves the ef nearest elements to q in ctx.w, nearest first.
+    // both heaps are flat arrays reserved to their final size. the distance of the furthest result is cached
+    // in lower_bound, and the link block of the next candidate and the data of the next neighbor are
+    // prefetched while the current neighbor is scored.
+    // points accept rejects, deleted ones or those a filter leaves out, are still expanded but do not enter
+    // the results, and the search then goes on until ef accepted points are found.
+    // with a stop rule the k nearest accepted distances are also kept in ctx.nearest, and the search ends early
+    // once stop.patience expansions in a row did not improve them.
+    template<typename Accept = accept_all>
+    void search_layer(search_context &ctx, const float *q, uint32_t ep, int ef, int lc,
+                      const Accept &accept = Accept(), stop_rule stop = stop_rule()) const {
+        constexpr bool filtered = !std::is_same_v<Accept, accept_all>;
+        std::vector<std::pair<float, uint32_t> > &candidates = ctx.candidates; // set of candidates
+        std::vector<std::pair<float, uint32_t> > &w = ctx.w;          // dynamic list of found nearest neighbors
+        visited_list &v = ctx.visited;                                // set of visited elements
+        candidates.clear();
+        w.clear();
+        w.reserve(ef + 1);
+        v.reset(reserved_capacity);
+
+        float d = dist_to_query(ctx, ep, q);
+        v.insert(ep);
+        ctx.stats.visited++;
+        candidates.emplace_back(-d, ep);
+        float lower_bound = std::numeric_limits<float>::max();        // distance of the furthest element of w
+        if (!filtered || accept(ep)) {
+            w.emplace_back(d, ep);
+            lower_bound = d;
+        }
+        std::vector<float> &nearest = ctx.nearest;
+        nearest.assign(w.empty() || stop.patience == 0 ? 0 : 1, d);
+        int stalled = 0;                                              // expansions since nearest last changed
+
+        while (!candidates.empty()) {
+            std::pop_heap(candidates.begin(), candidates.end());
+            uint32_t c = candidates.back().second; // extract nearest element from c to q
+            float c_dist = candidates.back().first;
+            candidates.pop_back();
+            ctx.stats.heap_operations++;
+            if (-c_dist > lower_bound && (!filtered || w.size() >= ef)) {
+                break;
+            }
+            if (!candidates.empty()) {
+                __builtin_prefetch(get_links(candidates.front().second, lc), 0, 3);
+            }
+            ctx.stats.hops++;
+
+            // while building concurrently the block is copied under its lock, otherwise it is scanned in place
+            const uint32_t *neighbors;
+            size_t count;
+            if (concurrent_build) {
+                read_links(c, lc, ctx.links);
+                neighbors = ctx.links.data();
+                count = ctx.links.size();
+            } else {
+                const uint32_t *block = get_links(c, lc);
+                neighbors = block + 1;
+                count = block[0];
+            }
+            if (count > 0) {
+                v.prefetch(neighbors[0]);
+                prefetch_point(neighbors[0]);
+            }
+            for (size_t j = 0; j < count; j++) {
+                uint32_t e = neighbors[j];
+                if (j + 1 < count) {
+                    v.prefetch(neighbors[j + 1]);
+                    prefetch_point(neighbors[j + 1]);
+                }
+                if (v.contains(e)) {
+                    continue;
+                }
+                v.insert(e);
+                ctx.stats.visited++;
+                // record parent
+                if (ctx.record_parents) {
+                    ctx.parents[e] = c;
+                }
+                float distance_e_q = dist_to_query(ctx, e, q);
+                if (distance_e_q < lower_bound || w.size() < ef) {
+                    candidates.emplace_back(-distance_e_q, e);
+                    std::push_heap(candidates.begin(), candidates.end());
+                    ctx.stats.heap_operations++;
+                    if (filtered && !accept(e)) {
+                        continue;
+                    }
+                    w.emplace_back(distance_e_q, e);
+                    std::push_heap(w.begin(), w.end());
+                    ctx.stats.heap_operations++;
+                    if (w.size() > ef) {
+                        std::pop_heap(w.begin(), w.end());
+                        w.pop_back();
+                        ctx.stats.heap_operations++;
+                    }
+                    lower_bound = w.front().first;
+                    if (stop.patience > 0 && (nearest.size() < stop.k || distance_e_q < nearest.front())) {
+                        if (nearest.size() == stop.k) {
+                            std::pop_heap(nearest.begin(), nearest.end());
+                            nearest.pop_back();
+                        }
+                        nearest.push_back(distance_e_q);
+                        std::push_heap(nearest.begin(), nearest.end());
+                        stalled = -1;
+                    }
+                }
+            }
+            if (stop.patience > 0 && ++stalled >= stop.patience) {
+                break;
+            }
+        }
+        std::sort_heap(w.begin(), w.end());
+    }
+
+    // adds q to the lists of its new neighbors ctx.chosen at layer lc. a list with a free slot takes q right
+    // away, the full ones are shrunk afterwards in one batch: each neighbor selects again among its links and q,
+    // its exact distance to q known from the selection of q and, during build_graph, the distances to its
+    // links from link_distances.
+    void link_back(search_context &ctx, uint32_t q, int lc) {
+        // if lc = 0 then m_max = m_max_0
+        size_t m_effective = lc == 0 ? m_max_0 : m_max;
+        ctx.overflowed.clear();
+        for (const std::pair<float, uint32_t> &n: ctx.chosen) {
+            uint32_t e = n.second;
+            std::unique_lock<std::mutex> lock(link_lock(e), std::defer_lock);
+            if (concurrent_build) {
+                lock.lock();
+            }
+            uint32_t *e_block = get_links(e, lc);
+            if (e == q || std::find(e_block + 1, e_block + 1 + e_block[0], q) != e_block + 1 + e_block[0]) {
+                continue; // already connected, when updating
+            }
+            if (e_block[0] < m_effective) {
+                append_link(e, lc, q, n.first);
+            } else {
+                ctx.overflowed.push_back(n);
+            }
+        }
+
+        // shrink connections, the list is read again under its lock as other inserts may have changed it since
+        for (size_t i = 0; i < ctx.overflowed.size(); i++) {
+            uint32_t e = ctx.overflowed[i].second;
+            if (i + 1 < ctx.overflowed.size()) {
+                __builtin_prefetch(get_links(ctx.overflowed[i + 1].second, lc), 0, 3);
+            }
+            std::unique_lock<std::mutex> lock(link_lock(e), std::defer_lock);
+            if (concurrent_build) {
+                lock.lock();
+            }
+            uint32_t *e_block = get_links(e, lc);
+            if (std::find(e_block + 1, e_block + 1 + e_block[0], q) != e_block + 1 + e_block[0]) {
+                continue;
+            }
+            if (e_block[0] < m_effective) {
+                append_link(e, lc, q, ctx.overflowed[i].first);
+                continue;
+            }
+            std::vector<std::pair<float, uint32_t> > &c = ctx.shrink_candidates;
+            c.clear();
+            const float *distances = distance_block(e, lc);
+            for (uint32_t j = 1; j <= e_block[0]; j++) {
+                c.emplace_back(distances != nullptr ? distances[j] : pair_dist(ctx, e, e_block[j]), e_block[j]);
+            }
+            c.emplace_back(ctx.overflowed[i].first, q);
+            std::sort(c.begin(), c.end());
+            select_neighbors(ctx, e, c, m_effective, ctx.shrunk);
+            set_links(e, lc, ctx.shrunk); // set neighborhood(e) at layer lc to the selection
+        }
+    }
+
+    // picks up to m neighbors of base among the candidates c, sorted nearest first by their distance to base,
+    // with the algorithm of select_neighbors_mode. out must not be c.
+    void select_neighbors(search_context &ctx, uint32_t base, const std::vector<std::pair<float, uint32_t> > &c,
+                          size_t m, std::vector<std::pair<float, uint32_t> > &out) {
+        if (select_neighbors_mode == "simple") {
+            select_neighbors_simple(c, m, out);
+        } else if (select_neighbors_mode == "heuristic") {
+            select_neighbors_heuristic(ctx, base, c, m, false, out);
+        } else {
+            throw std::runtime_error("select_neighbors_mode should be simple/heuristic");
+        }
+    }
+
+    // the m nearest candidates
+    static void select_neighbors_simple(const std::vector<std::pair<float, uint32_t> > &c, size_t m,
+                                        std::vector<std::pair<float, uint32_t> > &out) {
+        out.assign(c.begin(), c.begin() + std::min(c.size(), m));
+    }
+
+    // heuristic of the hnsw paper (algorithm 4) on candidates sorted nearest first by their distance to base:
+    // a candidate is kept when it is nearer to base than to every neighbor kept before it, so the links spread
+    // out around base instead of all going the same way. with keep_pruned_connections the nearest pruned
+    // candidates fill the slots left. the candidates are not extended with their own neighbors: that reads
+    // other link lists, which link_back cannot do while it holds the lock of the list it shrinks. all buffers
+    // are in ctx, no call allocates once they have grown.
+    void select_neighbors_heuristic(search_context &ctx, uint32_t base,
+                                    const std::vector<std::pair<float, uint32_t> > &c, size_t m,
+                                    bool keep_pruned_connections, std::vector<std::pair<float, uint32_t> > &out) {
+        out.clear();
+        ctx.pruned.clear();
+        for (size_t i = 0; i < c.size() && out.size() < m; i++) {
+            const std::pair<float, uint32_t> &e = c[i];
+            if (i + 1 < c.size()) {
+                prefetch_point(c[i + 1].second);
+            }
+            bool good = true;
+            for (const std::pair<float, uint32_t> &r: out) {
+                if (pair_dist(ctx, r.second, e.second) < e.first) {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) {
+                out.push_back(e);
+            } else if (keep_pruned_connections) {
+                ctx.pruned.push_back(e);
+            }
+        }
+        // add some of the discarded connections, nearest first
+        for (size_t i = 0; i < ctx.pruned.size() && out.size() < m; i++) {
+            out.push_back(ctx.pruned[i]);
+        }
+    }
+
+
+    // writes up to k nearest neighbors of q, nearest first, into result and returns how many were found.
+    // const and reentrant: every thread passes its own context, statistics stay in the context
+    // until merge_stats is called
+    size_t knn_search(search_context &ctx, const float *q, int k, int ef, search_result *result) const {
+        if (deleted_count > 0) {
+            return search_accepting(ctx, q, k, ef, result, [this](uint32_t id) { return !deleted[id]; });
+        }
+        return search_accepting(ctx, q, k, ef, result, accept_all());
+    }
+
+    size_t knn_search(const float *q, int k, int ef, search_result *result) {
+        size_t count = knn_search(query_context, q, k, ef, result);
+        merge_stats(query_context);
+        return count;
+    }
+
+    // knn_search without a fixed ef: layer 0 keeps up to the calibrated ef_max candidates but stops as soon as
+    // patience expansions in a row left the k nearest unchanged, so easy queries stop early and hard ones search
+    // on. the rule comes from calibrate_adaptive or set_adaptive_search, throws runtime_error without one.
+    size_t knn_search_adaptive(search_context &ctx, const float *q, int k, search_result *result) const {
+        if (element_count.load(std::memory_order_acquire) == 0) {
+            return 0;
+        }
+        if (adaptive_patience == 0) {
+            throw std::runtime_error("knn_search_adaptive: no stopping rule, call calibrate_adaptive first");
+        }
+        stop_rule stop{k, adaptive_patience};
+        int ef = std::max(adaptive_ef, k);
+        if (deleted_count > 0) {
+            return search_accepting(ctx, q, k, ef, result, [this](uint32_t id) { return !deleted[id]; }, stop);
+        }
+        return search_accepting(ctx, q, k, ef, result, accept_all(), stop);
+    }
+
+    size_t knn_search_adaptive(const float *q, int k, search_result *result) {
+        size_t count = knn_search_adaptive(query_context, q, k, result);
+        merge_stats(query_context);
+        return count;
+    }
+
+    void set_adaptive_search(int patience, int ef_max) {
+        adaptive_patience = patience;
+        adaptive_ef = ef_max;
+    }
+
+    std::pair<int, int> get_adaptive_search() const {
+        return {adaptive_patience, adaptive_ef};
+    }
+
+    // calibrates knn_search_adaptive on sample queries drawn like the real ones, e.g. rows of a learn set: picks
+    // the smallest patience whose recall@k on the sample reaches target_recall, by bisection with the layer 0
+    // list capped at ef_max (ADAPTIVE_EF_FACTOR * k when 0). recall only grows with patience up to the recall of
+    // a plain search with ef_max, which is the best it can reach. the exact neighbors of the sample come from a
+    // brute force pass over the fp32 vectors, throws runtime_error once they were released. the rule stays in
+    // effect until the next calibration and is not saved with the index. returns the sample recall reached.
+    template<typename Rows>
+    double calibrate_adaptive(const Rows &sample, int k, double target_recall, int ef_max = 0) {
+        ef_max = std::max(ef_max == 0 ? ADAPTIVE_EF_FACTOR * k : ef_max, k);
+        std::vector<std::vector<label_t> > truth = sample_truth(sample, k);
+        auto recall = [&](int patience) {
+            adaptive_patience = patience;
+            adaptive_ef = ef_max;
+            return sample_recall(sample, truth, k, [&](search_context &ctx, const float *q, search_result *result) {
+                return knn_search_adaptive(ctx, q, k, result);
+            });
+        };
+        int patience = bisect_recall(1, ef_max, target_recall, recall);
+        return recall(patience);
+    }
+
+    // smallest fixed ef for which knn_search reaches target_recall at k on the sample, the baseline the adaptive
+    // search is measured against. ef is searched in [k, ef_max], ef_max being ADAPTIVE_EF_FACTOR * k when 0.
+    template<typename Rows>
+    int calibrate_ef(const Rows &sample, int k, double target_recall, int ef_max = 0) {
+        ef_max = std::max(ef_max == 0 ? ADAPTIVE_EF_FACTOR * k : ef_max, k);
+        std::vector<std::vector<label_t> > truth = sample_truth(sample, k);
+        return bisect_recall(k, ef_max, target_recall, [&](int ef) {
+            return sample_recall(sample, truth, k, [&](search_context &ctx, const float *q, search_result *result) {
+                return knn_search(ctx, q, k, ef, result);
+            });
+        });
+    }
+
+    // like knn_search, but only points whose label filter accepts are returned. filter is a filter_bitset or
+    // any callable bool(label_t). points that do not match are still traversed, so the graph stays connected
+    // whatever the filter, and layer 0 is searched until ef matches are found: the fewer points match, the
+    // further the search expands. a filtered graph search scores about 3 * ef / s points for a selectivity s,
+    // each about three times as costly as a point of a sequential scan, so the s * n matches are scanned
+    // instead when s * n < SCAN_FACTOR * ef / s. they are also scanned when the graph search comes back with
+    // fewer than k.
+    template<typename Filter>
+    size_t knn_search_filtered(search_context &ctx, const float *q, int k, int ef, search_result *result,
+                               const Filter &filter) const {
+        auto accept = [&](uint32_t id) { return !deleted[id] && filter(labels[id]); };
+        double selectivity = estimate_selectivity(filter);
+        double matches = selectivity * (element_count.load(std::memory_order_acquire) - deleted_count);
+        if (matches * selectivity < SCAN_FACTOR * ef) {
+            ctx.stats.queries++;
+            ctx.stats.scans++;
+            return scan(ctx, q, k, result, accept);
+        }
+        size_t count = search_accepting(ctx, q, k, std::max(ef, k), result, accept);
+        if (count < k) {
+            ctx.stats.scans++;
+            count = scan(ctx, q, k, result, accept);
+        }
+        return count;
+    }
+
+    template<typename Filter>
+    size_t knn_search_filtered(const float *q, int k, int ef, search_result *result, const Filter &filter) {
+        size_t count = knn_search_filtered(query_context, q, k, ef, result, filter);
+        merge_stats(query_context);
+        return count;
+    }
+
+    // calls callback(label, distance) once for every point within distance radius of q, in the order they
+    // are found, and returns their number. nothing is collected, so result sets of any size stream through
+    // the callback. radius is in the units of search results, a squared distance for l2. the upper layers
+    // are descended as in knn_search, layer 0 is expanded for as long as the nearest unexpanded point lies
+    // within the radius or among the ef nearest seen, so ef only sets the margin explored past the border.
+    // on a compressed index the traversal runs on the codes and, with re-ranking, points are confirmed with
+    // their exact distance.
+    template<typename Callback>
+    size_t range_search(search_context &ctx, const float *q, float radius, int ef, Callback &&callback) const {
+        if (element_count.load(std::memory_order_acquire) == 0) {
+            return 0;
+        }
+        q = normalize_query(ctx, q);
+        prepare_query(ctx, q);
+        uint32_t ep = this->enter_point;
+        for (int lc = levels[ep]; lc > 0; lc--) {
+            search_layer(ctx, q, ep, 1, lc);
+            ep = ctx.w[0].second;
+        }
+
+        bool exact = storage != storage_type::fp32 && rerank;
+        size_t found = 0;
+        auto emit = [&](uint32_t id, float d) {
+            if (exact) {
+                const float *v = exact_vector(id);
+                if (v != nullptr && (d = dist(ctx, v, q)) > radius) {
+                    return;
+                }
+            }
+            callback(labels[id], d);
+            found++;
+        };
+        range_layer(ctx, q, ep, radius, ef, emit);
+        ctx.stats.queries++;
+        return found;
+    }
+
+    template<typename Callback>
+    size_t range_search(const float *q, float radius, int ef, Callback &&callback) {
+        size_t found = range_search(query_context, q, radius, ef, callback);
+        merge_stats(query_context);
+        return found;
+    }
+
+    // answers the n queries stored row after row in queries (n x dim floats). the up to k results of query i
+    // go to results[i * k...], their number to counts[i]. runs on one thread per context, contexts keep their
+    // buffers from batch to batch.
+    void knn_search_batch(std::vector<search_context> &contexts, const float *queries, size_t n, int k, int ef,
+                          search_result *results, size_t *counts) const {
+        parallel_for(0, n, contexts.size(), [&](size_t i, size_t thread_id) {
+            counts[i] = knn_search(contexts[thread_id], queries + i * dim, k, ef, results + i * k);
+        });
+    }
+
+    // same on num_threads threads with contexts owned by the index, the statistics are merged.
+    // not reentrant, like the single query overload.
+    void knn_search_batch(const float *queries, size_t n, int k, int ef, search_result *results, size_t *counts) {
+        batch_contexts.resize(resolve_num_threads(num_threads));
+        knn_search_batch(batch_contexts, queries, n, k, ef, results, counts);
+        for (search_context &ctx: batch_contexts) {
+            merge_stats(ctx);
+        }
+    }
+
+    // exact k nearest neighbors of q over every point of the index, nearest first
+    size_t knn_search_brute_force(const float *q, int k, search_result *result) {
+        return knn_search_brute_force(q, k, result, accept_all());
+    }
+
+    // same over the points whose label filter accepts
+    template<typename Filter>
+    size_t knn_search_brute_force(const float *q, int k, search_result *result, const Filter &filter) {
+        search_context ctx;
+        size_t count = scan(ctx, q, k, result, [&](uint32_t id) { return !deleted[id] && filter(labels[id]); });
+        distance_calculation_count += ctx.stats.distance_calculation_count;
+        return count;
+    }
+
+    // exact counterpart of range_search, scores every point
+    template<typename Callback>
+    size_t range_search_brute_force(const float *q, float radius, Callback &&callback) {
+        search_context ctx;
+        q = normalize_query(ctx, q);
+        prepare_query(ctx, q);
+        size_t found = 0;
+        size_t n = element_count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+            if (deleted[i]) {
+                continue;
+            }
+            float d = vectors != nullptr ? dist(ctx, get_vector(i), q) : dist_to_query(ctx, i, q);
+            if (d <= radius) {
+                callback(labels[i], d);
+                found++;
+            }
+        }
+        distance_calculation_count += ctx.stats.distance_calculation_count;
+        return found;
+    }
+};
+
+typedef basic_hnsw<metric_l2> HNSW;
+
+#endif //UNTITLED_HNSW_H
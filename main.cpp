@@ -11,734 +11,1170 @@
 #include <chrono>
 #include <cstdlib>
 #include <map>
+#include <random>
+#include <thread>
+#include <atomic>
 #include <string>
 #include <sstream>
+#include "hnsw.h"
+#include "dataset.h"
 
 using namespace std;
 using namespace chrono;
 
-float calculate_recall(const std::vector<std::vector<float> > &sample, const std::vector<std::vector<float> > &base) {
-    struct hashFunction {
-        size_t operator()(const std::vector<float>
-                          &myVector) const {
-            std::hash<int> hasher;
-            size_t answer = 0;
-
-            for (int i: myVector) {
-                answer ^= hasher(i) + 0x9e3779b9 +
-                          (answer << 6) + (answer >> 2);
-            }
-            return answer;
-        }
-    };
+// fraction of the true neighbors found among the labels of the result
+float calculate_recall(const search_result *result, size_t count, const std::vector<label_t> &truth) {
+    std::unordered_set<label_t> s(truth.begin(), truth.end());
     int hit = 0;
-    std::unordered_set < std::vector<float>, hashFunction > s;
-    for (std::vector<float> v: base) {
-        s.insert(v);
+    for (size_t i = 0; i < count; i++) {
+        if (s.find(result[i].label) != s.end()) {
+            hit++;
+        }
     }
+    return (float) hit / truth.size();
+}
 
-    for (std::vector<float> v: sample) {
-        if (s.find(v) != s.end()) {
-            hit++;
+
+// query_result holds k slots per query, result_count how many of them were filled.
+// without ground truth the exact neighbors come from a brute force search of the index
+template<typename Index>
+float average_recall(const std::vector<search_result> &query_result, const std::vector<size_t> &result_count, int k,
+                     const vecs_data<float> &query_load,
+                     const vecs_data<int32_t> &groundtruth_load, Index &hnsw) {
+    std::vector<float> total_recall;
+    std::vector<search_result> exact(k);
+    for (int i = 0; i < query_load.size(); i++) {
+        std::vector<label_t> truth;
+        if (groundtruth_load.size() != 0) {
+            for (int j = 0; j < k && j < groundtruth_load.dim(); j++) {
+                truth.push_back((label_t) groundtruth_load[i][j]);
+            }
+        } else {
+            size_t count = hnsw.knn_search_brute_force(query_load[i], k, exact.data());
+            for (size_t j = 0; j < count; j++) {
+                truth.push_back(exact[j].label);
+            }
         }
+        total_recall.emplace_back(calculate_recall(query_result.data() + i * k, result_count[i], truth));
     }
-    return (float) hit / base.size();
+    return std::accumulate(total_recall.begin(), total_recall.end(), 0.0) / total_recall.size();
 }
 
-float
-calculate_recall(const std::vector<std::vector<float> > &sample, const std::vector<std::vector<float> > &base_load,
-                 const vector<float> &index) {
-    std::vector<std::vector<float> > base;
-    for (int i = 0; i < index.size(); i++) {
-        base.push_back(base_load[index[i]]);
+// the index the modes measure unless they vary it: m 16, ef_construction 32, simple selection, built on all cores
+template<typename Metric = metric_l2>
+struct standard_index : basic_hnsw<Metric> {
+    explicit standard_index(const vecs_data<float> &base_load) : basic_hnsw<Metric>(16, 16, 32, 32, 1.0, "simple") {
+        this->set_num_threads(0);
+        this->build_graph(base_load);
     }
-    return calculate_recall(sample, base);
+};
+
+// results of answering every query with knn_search, k slots per query and how many of them were filled
+struct query_run {
+    std::vector<search_result> result;
+    std::vector<size_t> count;
+    float query_time = 0;                         // ms
+    float qps = 0;
+};
+
+template<typename Index>
+query_run run_queries(Index &hnsw, const vecs_data<float> &queries, int k, int ef_k) {
+    query_run run;
+    run.result.resize(queries.size() * k);
+    run.count.resize(queries.size());
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < queries.size(); i++) {
+        run.count[i] = hnsw.knn_search(queries[i], k, ef_k, run.result.data() + i * k);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    run.query_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+    run.qps = queries.size() / std::max(run.query_time / 1000, 1e-6f);
+    return run;
 }
 
+void
+build_graph_and_query(const vecs_data<float> &base_load,
+                      const vecs_data<float> &learn_load,
+                      const vecs_data<float> &query_load,
+                      const vecs_data<int32_t> &groundtruth_load,
+                      std::string file_name, HNSW &hnsw, int k, int ef_k) {
+    // initialize graph
+    auto start = std::chrono::high_resolution_clock::now();
+    hnsw.build_graph(base_load);
+    hnsw.print_graph_parameters();
+    std::cout << "distance kernel: " << simd_level_name(cpu_simd_level()) << std::endl;
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = duration_cast<std::chrono::milliseconds>(end - start);
+    float build_time = (float) duration.count();
+    auto build_count = hnsw.get_distance_calculation_count();
+    std::cout << "total time for building graph: " << build_time / 1000 << std::endl;
+    std::cout << "total distance count for building graph: " << build_count << std::endl;
+    std::cout << "index memory usage (MB): " << (float) hnsw.memory_usage() / (1 << 20) << std::endl;
 
-class Node {
-public:
-    std::vector<float> data;
-    std::vector<std::vector<Node *> > neighbors;
-    int level;
-    Node *parent;
+    // learn, the searches from here on are traced for the frequency distribution
+    hnsw.set_tracing(true);
+    std::vector<search_result> result(k);
+    for (size_t i = 0; i < learn_load.size(); i++) {
+        hnsw.knn_search(learn_load[i], k, ef_k, result.data());
+    }
 
-    Node(const std::vector<float> &d, const std::vector<std::vector<Node *> > &n, int l) {
-        this->data = d;
-        this->neighbors = n;
-        this->level = l;
-        this->parent = nullptr;
+    // base
+    for (size_t i = 0; i < base_load.size(); i++) {
+        hnsw.knn_search(base_load[i], k, ef_k, result.data());
     }
-};
 
-class HNSW {
-private:
-    // graph
-    std::vector<std::vector<float> > data;
-    Node *enter_point = nullptr;
-
-    // hyper parameters
-    int m;                                   // number of neighbors to connect in algo1
-    int m_max;                               // limit maximum number of neighbors in algo1
-    int m_max_0;                             // limit maximum number of neighbors at layer0 in algo1
-    int ef_construction;                     // size of dynamic candidate list
-    float ml;                                // normalization factor for level generation
-    std::string select_neighbors_mode;       // select which select neighbor algorithm to use
-
-    // statistics
-    unsigned long long int distance_calculation_count;           // count number of calling distance function
-    int level_one_hit_count;
-
-    float dist_l2(const std::vector<float> *v1, const std::vector<float> *v2) {
-        if (v1->size() != v2->size()) {
-            throw std::runtime_error("dist_l2: vectors sizes do not match");
-        }
-        distance_calculation_count++;
-        float dist = 0;
-        for (size_t i = 0; i < v1->size(); i++) {
-            dist += ((*v1)[i] - (*v2)[i]) * ((*v1)[i] - (*v2)[i]);
-        }
-        return sqrt(dist);
-    }
-
-public:
-    map<std::vector<float> , Node*> umap;
-    std::vector<std::vector<Node *> > graph;
-    std::map<Node *, std::map<Node *, std::map<int, int> > > edge_map;
-
-    std::vector<float> report_neighbor_connection() {
-        std::vector<float> connectiveness;
-        for (int l = 0; l < graph.size(); l++) {
-            float connection_level = 0;
-            for (Node * n : graph[l]) {
-                auto closest_neighbors = this->knn_search_brute_force(n, graph[l], n->neighbors[l].size());
-                std::vector<std::vector<float> > connected_neighbors;
-                for (Node *ne : n->neighbors[l]) {
-                    connected_neighbors.push_back(ne->data);
+    // query, the whole set as one batch
+    std::vector<float> queries(query_load.size() * query_load.dim());
+    query_load.read_rows(0, query_load.size(), queries.data());
+    start = std::chrono::high_resolution_clock::now();
+    hnsw.set_distance_calculation_count(0);
+    hnsw.set_profiling(true);
+    search_stats stats_before = hnsw.get_search_stats();
+    std::vector<search_result> query_result(query_load.size() * k);
+    std::vector<size_t> result_count(query_load.size());
+    hnsw.knn_search_batch(queries.data(), query_load.size(), k, ef_k, query_result.data(), result_count.data());
+    end = std::chrono::high_resolution_clock::now();
+    duration = duration_cast<std::chrono::milliseconds>(end - start);
+    float query_time = (float) duration.count();
+    auto query_count = hnsw.get_distance_calculation_count();
+    std::cout << "total time for query: " << query_time / 1000 << std::endl;
+    std::cout << "total distance count for query: " << query_count << std::endl;
+    std::cout << "distance count per query: " << (float) query_count / query_load.size() << ", hops per query: "
+              << (float) (hnsw.get_search_stats().hops - stats_before.hops) / query_load.size() << std::endl;
+    query_profile profile = hnsw.get_query_profile();
+    hnsw.set_profiling(false);
+    std::cout << "query latency (us) p50: " << profile.latency_ns.percentile(0.5) / 1000.0 << ", p90: "
+              << profile.latency_ns.percentile(0.9) / 1000.0 << ", p99: "
+              << profile.latency_ns.percentile(0.99) / 1000.0 << ", p999: "
+              << profile.latency_ns.percentile(0.999) / 1000.0 << std::endl;
+
+    // frequency distribution
+    int non_zero_count = 0;
+    int zero_count = 0;
+    for (int l = 0; l < hnsw.graph.size(); l++) {
+        std::cout << "level " << l << std::endl;
+        int count = 0;
+        for (uint32_t a : hnsw.graph[l]) {
+            std::cout << "node " << a << ": ";
+            const uint32_t *counts = hnsw.edge_counts(a, l);
+            std::cout << counts[0] << " | ";
+            count += counts[0];
+            for (size_t j = 1; j <= hnsw.get_neighbors(a, l).size(); j++) {
+                non_zero_count++;
+                if (counts[j] == 0) {
+                    zero_count++;
                 }
-                connection_level += calculate_recall(connected_neighbors, closest_neighbors);
+                std::cout << counts[j] << " ";
+                count += counts[j];
             }
-            connectiveness.push_back(connection_level / graph[l].size());
+            std::cout << std::endl;
         }
-        return connectiveness;
+        std::cout << "level " << l << " total count: " << count << std::endl;
     }
+    std::cout << "non_zero_count: " << non_zero_count << std::endl;
+    std::cout << "zero_count: " << zero_count << std::endl;
 
-    HNSW(int m, int m_max, int m_max_0, int ef_construction, float ml, const std::string &select_neighbors_mode) {
-        srand(42);
-        this->m = m;
-        this->m_max = m_max;
-        this->m_max_0 = m_max_0;
-        this->ef_construction = ef_construction;
-        this->ml = ml;
-        this->select_neighbors_mode = select_neighbors_mode;
-        this->distance_calculation_count = 0;
-        this->level_one_hit_count = 0;
-        this->enter_point = nullptr;
-    }
+    // calculate recall
+    float avg_recall = average_recall(query_result, result_count, k, query_load, groundtruth_load, hnsw);
+    std::cout << "recall: " << avg_recall << std::endl;
 
-    std::tuple<int, int, int, int, float, std::string> get_graph_parameters() {
-        return std::make_tuple(m, m_max, m_max_0, ef_construction, ml, select_neighbors_mode);
-    }
+    // level one hit rate
+    float level_one_hit_rate = (float) hnsw.get_level_one_hit_count() / query_load.size();
+    std::cout << "level_one_hit_count: " << level_one_hit_rate << std::endl;
 
-    unsigned long long int get_distance_calculation_count() const {
-        return distance_calculation_count;
+    // sampled link recall per layer, see diagnose
+    graph_diagnostics diagnostics = hnsw.diagnose();
+    std::string connection_accuracy;
+    for (const layer_diagnostics &layer: diagnostics.layers) {
+        connection_accuracy += std::to_string(layer.link_recall) + " ";
     }
 
-    int get_level_one_hit_count() const {
-        return level_one_hit_count;
-    }
+    // write to csv file
+    std::fstream file(file_name, std::ios_base::app);
+    auto p = hnsw.get_graph_parameters();
+    int m, m_max, m_max_0, ef_construction;
+    float ml;
+    std::string select_neighbors_mode;
+    std::tie(m, m_max, m_max_0, ef_construction, ml, select_neighbors_mode) = p;
+    file << m << "," << m_max << "," << m_max_0 << "," << ef_construction << "," << ml << ","
+         << select_neighbors_mode << ","
+         << build_time << "," << query_time << "," << build_count << "," << query_count << "," << avg_recall << ","
+         << connection_accuracy << "," << k << "," << ef_k << "," << level_one_hit_rate << ","
+         << profile.latency_ns.percentile(0.5) / 1000.0 << "," << profile.latency_ns.percentile(0.99) / 1000.0 << ","
+         << profile.latency_ns.percentile(0.999) / 1000.0 << "\n";
+    file.close();
+}
 
-    void set_distance_calculation_count(unsigned long long int set_count) {
-        distance_calculation_count = set_count;
-    }
 
-    void print_graph_parameters() {
-        std::cout << "m=" << m << ", m_max=" << m_max << ", m_max_0=" << m_max_0 << ", ef_construction="
-                  << ef_construction << ", ml=" << ml << ", select_neighbor=" << select_neighbors_mode << std::endl;
+// builds the same graph with 1, 2, 4, ... threads up to all cores and reports the speedup over one thread
+void build_thread_scaling(const vecs_data<float> &base_load,
+                          const vecs_data<float> &query_load,
+                          const vecs_data<int32_t> &groundtruth_load,
+                          std::string file_name, int k, int ef_k) {
+    std::fstream file(file_name, std::ios_base::out);
+    file << "threads,total_time_for_building_graph,speedup,total_distance_count_for_building_graph,recall\n";
+    size_t max_threads = resolve_num_threads(0);
+    float single_thread_time = 0;
+    for (size_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        HNSW hnsw = HNSW(16, 16, 32, 32, 1.0, "simple");
+        hnsw.set_num_threads(threads);
+        auto start = std::chrono::high_resolution_clock::now();
+        hnsw.build_graph(base_load);
+        auto end = std::chrono::high_resolution_clock::now();
+        float build_time = (float) duration_cast<std::chrono::milliseconds>(end - start).count();
+        auto build_count = hnsw.get_distance_calculation_count();
+        if (threads == 1) {
+            single_thread_time = build_time;
+        }
+
+        query_run run = run_queries(hnsw, query_load, k, ef_k);
+        float avg_recall = average_recall(run.result, run.count, k, query_load, groundtruth_load, hnsw);
+        float speedup = single_thread_time / std::max(build_time, 1.0f);
+
+        std::cout << "threads: " << threads << ", build time: " << build_time / 1000 << ", speedup: " << speedup
+                  << ", recall: " << avg_recall << std::endl;
+        file << threads << "," << build_time << "," << speedup << "," << build_count
+             << "," << avg_recall << "\n";
+        if (threads == max_threads) {
+            break;
+        }
     }
+    file.close();
+}
 
-    static void log_progress(int curr, int total) {
-        int barWidth = 70;
-        if (curr % (total / 100) != 0) {
-            return;
+// answers query_load with 1, 2, 4, ... threads up to all cores on one index, each thread with its own context
+void query_thread_scaling(const vecs_data<float> &base_load,
+                          const vecs_data<float> &query_load,
+                          const vecs_data<int32_t> &groundtruth_load,
+                          std::string file_name, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "threads,total_time_for_query,qps,speedup,total_distance_count_for_query,recall\n";
+    size_t max_threads = resolve_num_threads(0);
+    float single_thread_qps = 0;
+    for (size_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        std::vector<search_context> contexts(threads);
+        std::vector<search_result> query_result(query_load.size() * k);
+        std::vector<size_t> result_count(query_load.size());
+        auto start = std::chrono::high_resolution_clock::now();
+        parallel_for(0, query_load.size(), threads, [&](size_t i, size_t thread_id) {
+            result_count[i] = hnsw.knn_search(contexts[thread_id], query_load[i], k, ef_k,
+                                             query_result.data() + i * k);
+        });
+        auto end = std::chrono::high_resolution_clock::now();
+        float query_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+        search_stats stats;
+        for (search_context &ctx: contexts) {
+            stats.add(ctx.stats);
         }
-        float progress = (float) curr / total;
-        std::cout << std::flush << "\r";
-        std::cout << "[";
-        int pos = barWidth * progress;
-        for (int i = 0; i < barWidth; ++i) {
-            if (i < pos)
-                std::cout << "=";
-            else if (i == pos)
-                std::cout << ">";
-            else
-                std::cout << " ";
+        float qps = query_load.size() / std::max(query_time / 1000, 1e-6f);
+        if (threads == 1) {
+            single_thread_qps = qps;
         }
-        std::cout << "] " << int(progress * 100.0);
-
-        if (curr == total) {
-            std::cout << std::endl;
+        float speedup = qps / single_thread_qps;
+        float avg_recall = average_recall(query_result, result_count, k, query_load, groundtruth_load, hnsw);
+
+        std::cout << "threads: " << threads << ", qps: " << qps << ", speedup: " << speedup << ", recall: "
+                  << avg_recall << std::endl;
+        file << threads << "," << query_time << "," << qps << "," << speedup << ","
+             << stats.distance_calculation_count << "," << avg_recall << "\n";
+        if (threads == max_threads) {
+            break;
         }
     }
+    file.close();
+}
 
+// answers query_load in batches of 1, 16, 256 queries and as one batch on all cores and reports the qps.
+// queries are copied once into a contiguous matrix, like a serving tier collecting a micro-batch would.
+void batch_benchmark(const vecs_data<float> &base_load,
+                     const vecs_data<float> &query_load,
+                     const vecs_data<int32_t> &groundtruth_load,
+                     std::string file_name, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+
+    size_t n = query_load.size();
+    size_t dim = query_load.dim();
+    std::vector<float> queries(n * dim);
+    query_load.read_rows(0, n, queries.data());
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "batch_size,threads,total_time_for_query,qps,recall\n";
+    for (size_t batch_size: {(size_t) 1, (size_t) 16, (size_t) 256, n}) {
+        std::vector<search_result> query_result(n * k);
+        std::vector<size_t> result_count(n);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t begin = 0; begin < n; begin += batch_size) {
+            size_t count = std::min(batch_size, n - begin);
+            hnsw.knn_search_batch(queries.data() + begin * dim, count, k, ef_k, query_result.data() + begin * k,
+                                  result_count.data() + begin);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        float query_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+        float qps = n / std::max(query_time / 1000, 1e-6f);
+        float avg_recall = average_recall(query_result, result_count, k, query_load, groundtruth_load, hnsw);
+
+        std::cout << "batch size: " << batch_size << ", qps: " << qps << ", recall: " << avg_recall << std::endl;
+        file << batch_size << "," << resolve_num_threads(0) << "," << query_time << "," << qps << "," << avg_recall
+             << "\n";
+    }
+    file.close();
+}
 
-    void build_graph(const std::vector<std::vector<float> > &input) {
-        data = input;
-        std::cout << "building graph" << std::endl;
-
-        for (int i = 0; i < input.size(); i++) {
-            Node *node = new Node(input[i], std::vector<std::vector<Node *> >(), 0);
-            this->umap[node->data] = node;
-
-            // special case: the first node has no enter point to insert
-            if (enter_point == nullptr) {
-                enter_point = node;
-                node->neighbors.resize(1);
-                graph.resize(1);
-                graph[0].push_back(node);
+// answers query_load on one index with fp32, fp16 and int8 storage, with and without the exact fp32 re-rank,
+// and reports memory, qps and recall. memory_without_fp32 is what is left once release_vectors drops the
+// fp32 vectors, which is only possible without re-rank.
+void quantization_benchmark(const vecs_data<float> &base_load,
+                            const vecs_data<float> &query_load,
+                            const vecs_data<int32_t> &groundtruth_load,
+                            std::string file_name, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "storage,rerank,memory_mb,memory_without_fp32_mb,total_time_for_query,qps,recall\n";
+    for (storage_type storage: {storage_type::fp32, storage_type::fp16, storage_type::int8}) {
+        hnsw.quantize(storage);
+        for (bool rerank: {false, true}) {
+            if (storage == storage_type::fp32 && rerank) {
                 continue;
             }
-
-            insert(node, m, m_max, m_max_0, ef_construction, ml);
-
-            // add new node to specific layer of graph
-            while (graph.size() <= node->level) {
-                graph.emplace_back();
-            }
-            for (int l = 0; l <= node->level; l++) {
-                graph[l].push_back(node);
-            }
-
-            log_progress(i + 1, input.size());
+            hnsw.set_rerank(rerank);
+            query_run run = run_queries(hnsw, query_load, k, ef_k);
+            float avg_recall = average_recall(run.result, run.count, k, query_load, groundtruth_load, hnsw);
+            float memory = (float) hnsw.memory_usage() / (1 << 20);
+            float memory_without_fp32 = storage == storage_type::fp32 ? memory : (float) (hnsw.memory_usage() -
+                    hnsw.vector_memory_usage()) / (1 << 20);
+
+            std::cout << "storage: " << storage_type_name(storage) << ", rerank: " << rerank << ", memory (MB): "
+                      << memory << ", without fp32 (MB): " << memory_without_fp32 << ", qps: " << run.qps
+                      << ", recall: " << avg_recall << std::endl;
+            file << storage_type_name(storage) << "," << rerank << "," << memory << "," << memory_without_fp32
+                 << "," << run.query_time << "," << run.qps << "," << avg_recall << "\n";
         }
-
-        // insert the nearest neighbor in all layer
-        // for (int l = 0; l < graph.size(); l++) {
-        //     for (Node *nod: graph[l]) {
-        //         int m_effective = l == 0 ? this->m_max_0 : this->m_max;
-        //         vector<vector<float>> temp = knn_search_brute_force(nod, graph[l], m_effective);
-        //         std::vector<Node *> new_neighbors;
-        //         for (const auto& vec: temp) {
-        //             if (umap[vec]->data.size() == 0) {
-        //                 throw std::runtime_error("vector size is 0");
-        //             }
-        //             new_neighbors.push_back(umap[vec]);
-        //         }
-        //         nod->neighbors[l] = new_neighbors;
-        //     }
-        // }
     }
+    file.close();
+}
 
-    void insert(Node *q, int m, int m_max, int m_max_0, int ef_construction, float ml) {
-        std::priority_queue<std::pair<float, Node *> > w;
-        Node *ep = this->enter_point;
-        int l = ep->level;
-        int l_new = floor(-log((float) rand() / (RAND_MAX + 1.0)) * ml);
+// product quantization with m = 8, 16 and 32 bytes per vector, codebooks trained on learn_load. every setting
+// starts from the same saved fp32 index, answers query_load on the codes alone, then drops the fp32 vectors and
+// re-ranks from the memory-mapped base file. memory is what the index holds once the vectors are dropped.
+void pq_benchmark(const vecs_data<float> &base_load,
+                  const vecs_data<float> &learn_load,
+                  const vecs_data<float> &query_load,
+                  const vecs_data<int32_t> &groundtruth_load,
+                  std::string file_name, int k, int ef_k) {
+    std::string index_file = "pq_benchmark.hnsw";
+    {
+        standard_index<> hnsw(base_load);
+        hnsw.save(index_file);
+    }
+    const vecs_data<float> &train = learn_load.size() > 0 ? learn_load : base_load;
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "storage,m,rerank,training_time,memory_mb,vector_bytes_per_point,total_time_for_query,qps,recall\n";
+    auto measure = [&](HNSW &hnsw, const std::string &storage, size_t m, bool rerank, float training_time) {
+        query_run run = run_queries(hnsw, query_load, k, ef_k);
+        float avg_recall = average_recall(run.result, run.count, k, query_load, groundtruth_load, hnsw);
+        size_t bytes = storage == "fp32" ? hnsw.memory_usage() : hnsw.memory_usage() - hnsw.vector_memory_usage();
+        float memory = (float) bytes / (1 << 20);
+        size_t vector_bytes = storage == "fp32" ? hnsw.get_dim() * sizeof(float) : m;
+
+        std::cout << "storage: " << storage << ", m: " << m << ", rerank: " << rerank << ", training time (ms): "
+                  << training_time << ", memory (MB): " << memory << ", vector bytes per point: " << vector_bytes
+                  << ", qps: " << run.qps << ", recall: " << avg_recall << std::endl;
+        file << storage << "," << m << "," << rerank << "," << training_time << "," << memory << ","
+             << vector_bytes << "," << run.query_time << "," << run.qps << "," << avg_recall << "\n";
+    };
 
-        // update fields of node
-        q->level = l_new;
-        while (q->neighbors.size() <= l_new) {
-            q->neighbors.emplace_back();
+    {
+        HNSW hnsw = HNSW(0, 0, 0, 0, 0, "");
+        hnsw.load(index_file);
+        measure(hnsw, "fp32", 0, false, 0);
+    }
+    for (size_t m: {8, 16, 32}) {
+        if (base_load.dim() % m != 0) {
+            continue;
+        }
+        HNSW hnsw = HNSW(0, 0, 0, 0, 0, "");
+        hnsw.set_num_threads(0);
+        hnsw.load(index_file);
+        auto start = std::chrono::high_resolution_clock::now();
+        hnsw.quantize_pq(train, m);
+        auto end = std::chrono::high_resolution_clock::now();
+        float training_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+        hnsw.set_rerank(false);
+        measure(hnsw, "pq", m, false, training_time);
+
+        hnsw.release_vectors();
+        // a source without a row for some label would leave those candidates with code distances
+        bool refused = false;
+        try {
+            hnsw.set_rerank_source(base_load.slice(0, base_load.size() - 1));
+        } catch (const std::runtime_error &) {
+            refused = true;
         }
+        std::cout << "short re-rank source: " << (refused ? "refused, ok" : "accepted, FAILED") << std::endl;
+        hnsw.set_rerank_source(base_load);
+        hnsw.set_rerank(true);
+        measure(hnsw, "pq", m, true, training_time);
+    }
+    file.close();
+}
 
-        for (int lc = l; lc > l_new; lc--) {
-            w = search_layer(q, ep, 1, lc);
-            ep = w.top().second; // ep = nearest element from W to q
+// deletes 10% and then 30% of the base points in random order and measures latency and recall on the first
+// queries, once with the tombstones in the graph and once after repair. recall is against a brute force search
+// over the points left. the last row moves 10% of the points left onto the vectors of deleted ones with update.
+void delete_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                      std::string file_name, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+    vecs_data<float> queries = query_load.slice(0, std::min(query_load.size(), (size_t) 1000));
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "deleted_fraction,state,size,deleted,operation_time,total_time_for_query,latency_us,qps,recall\n";
+    auto measure = [&](float fraction, const std::string &state, float operation_time) {
+        query_run run = run_queries(hnsw, queries, k, ef_k);
+        float latency = run.query_time * 1000 / queries.size();
+        float avg_recall = average_recall(run.result, run.count, k, queries, vecs_data<int32_t>(), hnsw);
+
+        std::cout << "deleted: " << fraction << ", " << state << ", size: " << hnsw.size() << ", tombstones: "
+                  << hnsw.deleted_size() << ", operation time (ms): " << operation_time << ", latency (us): "
+                  << latency << ", qps: " << run.qps << ", recall: " << avg_recall << std::endl;
+        file << fraction << "," << state << "," << hnsw.size() << "," << hnsw.deleted_size() << ","
+             << operation_time << "," << run.query_time << "," << latency << "," << run.qps << "," << avg_recall
+             << "\n";
+    };
+    measure(0, "built", 0);
+
+    std::vector<label_t> order(base_load.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+    size_t done = 0;
+    for (float fraction: {0.1f, 0.3f}) {
+        size_t target = (size_t) (fraction * base_load.size());
+        auto start = std::chrono::high_resolution_clock::now();
+        for (; done < target; done++) {
+            hnsw.mark_deleted(order[done]);
         }
+        auto end = std::chrono::high_resolution_clock::now();
+        measure(fraction, "tombstones",
+                    (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000);
+
+        start = std::chrono::high_resolution_clock::now();
+        hnsw.repair();
+        end = std::chrono::high_resolution_clock::now();
+        measure(fraction, "repaired", (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000);
+    }
 
-        for (int lc = std::min(l, l_new); lc >= 0; lc--) {
-            w = search_layer(q, ep, ef_construction, lc);
+    size_t updates = std::min(done, (base_load.size() - done) / 10);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < updates; i++) {
+        hnsw.update(order[done + i], base_load[order[i]]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    measure((float) done / base_load.size(), "updated",
+            (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000);
 
-            std::vector<Node *> neighbors;
-            if (select_neighbors_mode == "simple") {
-                neighbors = select_neighbors_simple(w, m);
-            } else if (select_neighbors_mode == "heuristic") {
-                neighbors = select_neighbors_heuristic(q, w, m, lc, true, false);
-            } else {
-                throw std::runtime_error("select_neighbors_mode should be simple/heuristic");
-            }
+    // deleting every point and repairing must leave an empty index that finds nothing, then takes new points
+    for (uint32_t id = 0; id < hnsw.size(); id++) {
+        hnsw.mark_deleted(hnsw.get_label(id));
+    }
+    hnsw.repair();
+    std::vector<search_result> result(k);
+    size_t found = hnsw.knn_search(queries[0], k, ef_k, result.data());
+    label_t added = hnsw.add(base_load[0]);
+    size_t found_after_add = hnsw.knn_search(base_load[0], k, ef_k, result.data());
+    // labels of dropped points stay retired, also across a save and load
+    std::string index_file = "delete_benchmark.hnsw";
+    hnsw.save(index_file);
+    HNSW loaded = HNSW(0, 0, 0, 0, 0, "");
+    loaded.load(index_file);
+    label_t added_after_load = loaded.add(base_load[1]);
+    bool empty_ok = hnsw.size() == 1 && found == 0 && found_after_add == 1 && result[0].label == added &&
+                    added >= base_load.size() && added_after_load == added + 1;
+    std::cout << "deleted: 1, repaired, size: 0, results: " << found << ", after one add: " << found_after_add
+              << ", new label: " << added << ", after load: " << added_after_load
+              << (empty_ok ? ", ok" : ", FAILED") << std::endl;
+    file << 1 << ",emptied," << 0 << "," << 0 << ",0,0,0,0," << (empty_ok ? 1 : 0) << "\n";
+    file.close();
+}
 
-            // add bidirectional connections from neighbors to q at layer lc
-            for (Node *e: neighbors) {
-                e->neighbors[lc].emplace_back(q);
-                q->neighbors[lc].emplace_back(e);
-            }
+// builds an index on the first half of the base, then adds the second half while query_threads threads keep
+// searching, either one add call per point or one add_batch on all cores. reports the sustained insert rate,
+// the throughput of the searches running meanwhile and the recall of the complete index on the first queries.
+void stream_benchmark(const vecs_data<float> &base_load,
+                      const vecs_data<float> &query_load,
+                      const vecs_data<int32_t> &groundtruth_load,
+                      std::string file_name, int k, int ef_k) {
+    std::string index_file = "stream_benchmark.hnsw";
+    size_t half = base_load.size() / 2;
+    {
+        standard_index<> hnsw(base_load.slice(0, half));
+        hnsw.save(index_file);
+    }
+    vecs_data<float> rest = base_load.slice(half, base_load.size());
+    vecs_data<float> queries = query_load.slice(0, std::min(query_load.size(), (size_t) 1000));
+
+    // an index that was only reserved is searched before its first add, as a server starting empty would be
+    {
+        HNSW hnsw = HNSW(16, 16, 32, 32, 1.0, "simple");
+        hnsw.reserve(base_load.size(), base_load.dim());
+        std::vector<search_result> result(k);
+        size_t found = hnsw.knn_search(queries[0], k, ef_k, result.data());
+        size_t in_range = hnsw.range_search(queries[0], std::numeric_limits<float>::max(), ef_k,
+                                            [](label_t, float) {});
+        label_t first = hnsw.add(base_load[0]);
+        size_t found_after_add = hnsw.knn_search(queries[0], k, ef_k, result.data());
+        bool empty_ok = found == 0 && in_range == 0 && found_after_add == 1 && result[0].label == first;
+        std::cout << "empty index: results: " << found << ", in range: " << in_range << ", after one add: "
+                  << found_after_add << (empty_ok ? ", ok" : ", FAILED") << std::endl;
+    }
 
-            // shrink connections if needed
-            for (Node *e: neighbors) {
-                // if lc = 0 then m_max = m_max_0
-                int m_effective = lc == 0 ? m_max_0 : m_max;
-
-                std::vector<Node *> e_conn = e->neighbors[lc];
-                if (e_conn.size() > m_effective) // shrink connections if needed
-                {
-                    std::vector<Node *> e_new_conn;
-                    if (select_neighbors_mode == "simple") {
-                        e_new_conn = select_neighbors_simple(e, e_conn, m_effective);
-                    } else if (select_neighbors_mode == "heuristic") {
-                        e_new_conn = select_neighbors_heuristic(e, e_conn, m_effective, lc, true, false);
-                    } else {
-                        throw std::runtime_error("select_neighbors_mode should be simple/heuristic");
+    std::fstream file(file_name, std::ios_base::out);
+    file << "api,query_threads,inserted,insert_time,inserts_per_sec,queries,qps,recall\n";
+    for (std::string api: {"add", "add_batch"}) {
+        for (size_t query_threads: {0, 1, 2, 4}) {
+            HNSW hnsw = HNSW(0, 0, 0, 0, 0, "");
+            hnsw.set_num_threads(0);
+            hnsw.load(index_file);
+            hnsw.reserve(base_load.size());
+            hnsw.set_concurrent_updates(true);
+
+            std::atomic<bool> done(false);
+            std::atomic<size_t> searched(0);
+            std::vector<std::thread> searchers;
+            for (size_t t = 0; t < query_threads; t++) {
+                searchers.emplace_back([&, t] {
+                    search_context ctx;
+                    std::vector<search_result> result(k);
+                    for (size_t i = t; !done; i++) {
+                        hnsw.knn_search(ctx, queries[i % queries.size()], k, ef_k, result.data());
+                        searched++;
                     }
-                    e->neighbors[lc] = e_new_conn; // set neighborhood(e) at layer lc to e_new_conn
+                });
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            if (api == "add") {
+                for (size_t i = 0; i < rest.size(); i++) {
+                    hnsw.add(rest[i]);
                 }
+            } else {
+                hnsw.add_batch(rest);
             }
-            ep = w.top().second;
-        }
-        if (l_new > l) {
-            this->enter_point = q;
+            auto end = std::chrono::high_resolution_clock::now();
+            done = true;
+            for (std::thread &t: searchers) {
+                t.join();
+            }
+            hnsw.set_concurrent_updates(false);
+            float insert_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+            float inserts_per_sec = rest.size() / std::max(insert_time / 1000, 1e-6f);
+            float qps = searched / std::max(insert_time / 1000, 1e-6f);
+
+            query_run run = run_queries(hnsw, queries, k, ef_k);
+            float avg_recall = average_recall(run.result, run.count, k, queries, groundtruth_load, hnsw);
+
+            std::cout << "api: " << api << ", query threads: " << query_threads << ", inserted: " << rest.size()
+                      << ", insert time (ms): " << insert_time << ", inserts/s: " << inserts_per_sec
+                      << ", concurrent qps: " << qps << ", recall: " << avg_recall << std::endl;
+            file << api << "," << query_threads << "," << rest.size() << "," << insert_time << ","
+                 << inserts_per_sec << "," << searched << "," << qps << "," << avg_recall << "\n";
         }
     }
+    file.close();
+}
 
-    std::priority_queue<std::pair<float, Node *> > search_layer(Node *q, Node *ep, int ef, int lc) {
-        float d = dist_l2(&(ep->data), &(q->data));
-        std::unordered_set<Node *> v{ep};                          // set of visited elements
-        std::priority_queue<std::pair<float, Node *> > candidates; // set of candidates
-        std::priority_queue<std::pair<float, Node *> > w;          // dynamic list of found nearest neighbors
-        candidates.emplace(-d, ep);
-        w.emplace(d, ep);
-
-        while (!candidates.empty()) {
-            Node *c = candidates.top().second; // extract nearest element from c to q
-            float c_dist = candidates.top().first;
-            candidates.pop();
-            Node *f = w.top().second; // get furthest element from w to q
-            float f_dist = w.top().first;
-            if (-c_dist > f_dist) {
-                break;
+// searches among a random selectivity fraction of the base for selectivities from 50% down to 0.1%: with a
+// filter_bitset, with a callable filter whose selectivity is sampled, and by over-fetching k / selectivity
+// results of an unfiltered search and filtering them afterwards. recall is against a filtered brute force,
+// scans is the fraction of queries the filtered search answered by scanning the matches.
+void filter_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                      std::string file_name, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+    vecs_data<float> queries = query_load.slice(0, std::min(query_load.size(), (size_t) 1000));
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "selectivity,method,matches,total_time_for_query,qps,recall,scans\n";
+    std::vector<label_t> order(base_load.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+    for (float selectivity: {0.5f, 0.2f, 0.1f, 0.05f, 0.01f, 0.005f, 0.001f}) {
+        size_t matches = std::max((size_t) 1, (size_t) (selectivity * base_load.size()));
+        filter_bitset allowed(base_load.size());
+        for (size_t i = 0; i < matches; i++) {
+            allowed.set(order[i]);
+        }
+        std::vector<std::vector<label_t> > truth(queries.size());
+        std::vector<search_result> exact(k);
+        for (size_t i = 0; i < queries.size(); i++) {
+            size_t count = hnsw.knn_search_brute_force(queries[i], k, exact.data(), allowed);
+            for (size_t j = 0; j < count; j++) {
+                truth[i].push_back(exact[j].label);
             }
-            for (Node *e: c->neighbors[lc]) {
-                if (v.find(e) == v.end()) {
-                    v.emplace(e);
-                    // record parent
-                    e->parent = c;
-                    f = w.top().second;
-                    float distance_e_q = dist_l2(&(e->data), &(q->data));
-                    float distance_f_q = dist_l2(&(f->data), &(q->data));
-                    if (distance_e_q < distance_f_q || w.size() < ef) {
-                        candidates.emplace(-distance_e_q, e);
-                        w.emplace(distance_e_q, e);
-                        if (w.size() > ef) {
-                            w.pop();
+        }
+
+        for (std::string method: {"bitset", "callable", "post_filter"}) {
+            std::vector<search_result> result(k);
+            std::vector<search_result> fetched;
+            float total_recall = 0;
+            unsigned long long int scans_before = hnsw.get_search_stats().scans;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < queries.size(); i++) {
+                size_t count = 0;
+                if (method == "bitset") {
+                    count = hnsw.knn_search_filtered(queries[i], k, ef_k, result.data(), allowed);
+                } else if (method == "callable") {
+                    count = hnsw.knn_search_filtered(queries[i], k, ef_k, result.data(),
+                                                     [&](label_t label) { return allowed(label); });
+                } else {
+                    int fetch = std::min((int) base_load.size(), (int) std::ceil(k / selectivity));
+                    fetched.resize(fetch);
+                    size_t found = hnsw.knn_search(queries[i], fetch, std::max(ef_k, fetch), fetched.data());
+                    for (size_t j = 0; j < found && count < k; j++) {
+                        if (allowed(fetched[j].label)) {
+                            result[count++] = fetched[j];
                         }
                     }
                 }
+                total_recall += calculate_recall(result.data(), count, truth[i]);
             }
+            auto end = std::chrono::high_resolution_clock::now();
+            float query_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+            float qps = queries.size() / std::max(query_time / 1000, 1e-6f);
+            float avg_recall = total_recall / queries.size();
+            float scans = (float) (hnsw.get_search_stats().scans - scans_before) / queries.size();
+
+            std::cout << "selectivity: " << selectivity << ", method: " << method << ", matches: " << matches
+                      << ", qps: " << qps << ", recall: " << avg_recall << ", scans: " << scans << std::endl;
+            file << selectivity << "," << method << "," << matches << "," << query_time << "," << qps << ","
+                 << avg_recall << "," << scans << "\n";
         }
-        std::priority_queue<std::pair<float, Node *> > min_w;
-        while (!w.empty()) {
-            min_w.emplace(-w.top().first, w.top().second);
-            w.pop();
-        }
-        return min_w;
     }
+    file.close();
+}
 
-    std::vector<Node *> select_neighbors_simple(std::priority_queue<std::pair<float, Node *> > c, int m) {
-        std::vector<Node *> neighbors;
-        while (neighbors.size() < m && !c.empty()) {
-            neighbors.emplace_back(c.top().second);
-            c.pop();
+// range searches on the first queries with a radius per query set to the distance of its 10th, 100th and
+// 1000th nearest neighbor, with a margin of 100 and 1000 points, checked against range_search_brute_force:
+// recall is the fraction of the points in the ball that were found, false positives are results outside of
+// it and must stay 0.
+void range_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                     std::string file_name) {
+    standard_index<> hnsw(base_load);
+    vecs_data<float> queries = query_load.slice(0, std::min(query_load.size(), (size_t) 100));
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "ball_size,ef_k,average_results,total_time_for_query,qps,brute_force_qps,recall,false_positives\n";
+    for (int ball_size: {10, 100, 1000}) {
+        if (ball_size > base_load.size()) {
+            continue;
+        }
+        std::vector<float> radius(queries.size());
+        std::vector<search_result> nearest(ball_size);
+        for (size_t i = 0; i < queries.size(); i++) {
+            size_t count = hnsw.knn_search_brute_force(queries[i], ball_size, nearest.data());
+            radius[i] = nearest[count - 1].distance;
         }
-        return neighbors;
-    }
 
-    std::vector<Node *> select_neighbors_simple(Node *q, const std::vector<Node *> &c, int m) {
-        std::priority_queue<std::pair<float, Node *> > w;
-        for (Node *e: c) {
-            w.emplace(dist_l2(&(e->data), &(q->data)), e);
-            if (w.size() > m) {
-                w.pop();
+        std::vector<std::unordered_set<label_t> > exact(queries.size());
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < queries.size(); i++) {
+            hnsw.range_search_brute_force(queries[i], radius[i], [&](label_t label, float) {
+                exact[i].insert(label);
+            });
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        float brute_force_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+
+        for (int ef_k: {100, 1000}) {
+            size_t results = 0, hits = 0, exact_total = 0, false_positives = 0;
+            start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < queries.size(); i++) {
+                results += hnsw.range_search(queries[i], radius[i], ef_k, [&](label_t label, float) {
+                    if (exact[i].count(label) != 0) {
+                        hits++;
+                    } else {
+                        false_positives++;
+                    }
+                });
+                exact_total += exact[i].size();
             }
+            end = std::chrono::high_resolution_clock::now();
+            float query_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+            float qps = queries.size() / std::max(query_time / 1000, 1e-6f);
+            float brute_force_qps = queries.size() / std::max(brute_force_time / 1000, 1e-6f);
+            float recall = (float) hits / exact_total;
+            float average_results = (float) results / queries.size();
+
+            std::cout << "ball size: " << ball_size << ", ef: " << ef_k << ", average results: " << average_results
+                      << ", qps: " << qps << ", brute force qps: " << brute_force_qps << ", recall: " << recall
+                      << ", false positives: " << false_positives << std::endl;
+            file << ball_size << "," << ef_k << "," << average_results << "," << query_time << "," << qps << ","
+                 << brute_force_qps << "," << recall << "," << false_positives << "\n";
         }
-        return select_neighbors_simple(w, m);
     }
+    file.close();
+}
 
-    std::vector<Node *> select_neighbors_heuristic(Node *q, std::priority_queue<std::pair<float, Node *> > c,
-                                                   int m, int lc, bool extend_candidates,
-                                                   bool keep_pruned_connections) {
-        std::vector<Node *> v;
-        while (!c.empty()) {
-            v.push_back(c.top().second);
-            c.pop();
+// exact k-nn of every query with exact_knn, written to ivecs_name. the first queries are also searched with one
+// distance call per base row, as report_neighbor_connection used to do, for the speedup. agreement is the
+// fraction of the ids of the ground truth file (of the per-row search without one) found in the exact result,
+// ties may order the last ones differently. also times report_neighbor_connection on an index of the base.
+void groundtruth_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                           const vecs_data<int32_t> &groundtruth_load, std::string file_name,
+                           std::string ivecs_name, int k) {
+    auto start = std::chrono::high_resolution_clock::now();
+    exact_knn_result exact = exact_knn<metric_l2>(base_load, query_load, k);
+    auto end = std::chrono::high_resolution_clock::now();
+    float exact_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+    save_ivecs_data(ivecs_name, exact.ids, k);
+
+    size_t naive_queries = std::min(query_load.size(), (size_t) 100);
+    dist_func_t l2_sqr = get_l2_sqr(base_load.dim());
+    std::vector<std::vector<int32_t> > naive(naive_queries);
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < naive_queries; i++) {
+        std::vector<std::pair<float, int32_t> > heap;
+        for (size_t j = 0; j < base_load.size(); j++) {
+            float d = l2_sqr(query_load[i], base_load[j], base_load.dim());
+            if (heap.size() < k) {
+                heap.emplace_back(d, (int32_t) j);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (d < heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = {d, (int32_t) j};
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        for (const auto &p: heap) {
+            naive[i].push_back(p.second);
         }
-        return select_neighbors_heuristic(q, v, m, lc, extend_candidates, keep_pruned_connections);
     }
-
-    std::vector<Node *> select_neighbors_heuristic(Node *q, const std::vector<Node *> &c,
-                                                   int m, int lc, bool extend_candidates,
-                                                   bool keep_pruned_connections) {
-        std::vector<Node *> r; // (max heap)
-        std::priority_queue<std::pair<float, Node *> > w; // working queue for the candidates (min_heap)
-        std::unordered_set<Node *> w_set;                 // this is to help check if e_adj is in w
-
-        for (Node *n: c) {
-            w.emplace(-dist_l2(&(q->data), &(n->data)), n);
-            w_set.emplace(n);
+    end = std::chrono::high_resolution_clock::now();
+    float naive_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+
+    size_t checked = groundtruth_load.size() != 0 ? std::min(groundtruth_load.size(), query_load.size())
+                                                  : naive_queries;
+    size_t agree = 0, total = 0;
+    for (size_t i = 0; i < checked; i++) {
+        std::unordered_set<int32_t> found(exact.ids.begin() + i * k, exact.ids.begin() + (i + 1) * k);
+        std::vector<int32_t> truth = naive[i % naive_queries];
+        if (groundtruth_load.size() != 0) {
+            truth.assign(groundtruth_load[i], groundtruth_load[i] + std::min((size_t) k, groundtruth_load.dim()));
         }
-
-        if (extend_candidates) {
-            for (Node *e: c) {
-                for (Node *e_adj: (e->neighbors)[lc]) {
-                    if (w_set.find(e_adj) == w_set.end()) {
-                        w.emplace(-dist_l2(&(q->data), &(e_adj->data)), e_adj);
-                        w_set.emplace(e_adj);
-                    }
-                }
-            }
+        for (int32_t id: truth) {
+            agree += found.count(id);
         }
+        total += truth.size();
+    }
 
-        std::priority_queue<std::pair<float, Node *> > w_d; // queue for the discarded candidates
-        while (!w.empty() && r.size() < m) {
-            Node *e = w.top().second;
-            float distance_e_q = w.top().first;
-            w.pop();
-//            if (r.empty() || distance_e_q < r.top().first) {
-//                r.emplace(distance_e_q, e);
-//            } else {
-//                w_d.emplace(-distance_e_q, e);
-//            }
-            bool good = true;
-            for (Node * rr : r) {
-                if (dist_l2(&rr->data, &e->data) < distance_e_q){
-                    good = false;
-                    break;
-                }
-            }
-            if (r.empty() || good){
-                r.push_back(e);
-            } else {
-                w_d.emplace(-distance_e_q, e);
-            }
-            if (keep_pruned_connections) { // add some of the discarded connections from w_d
-                while (!w_d.empty() && r.size() < m) {
-                    r.push_back(w_d.top().second);
-                    w_d.pop();
-                }
-            }
-        }
+    float qps = query_load.size() / std::max(exact_time / 1000, 1e-6f);
+    float naive_qps = naive_queries / std::max(naive_time / 1000, 1e-6f);
+    float agreement = (float) agree / std::max(total, (size_t) 1);
+    std::cout << "exact knn of " << query_load.size() << " queries (s): " << exact_time / 1000 << ", qps: " << qps
+              << ", per row qps: " << naive_qps << ", speedup: " << qps / naive_qps << ", agreement: " << agreement
+              << std::endl;
 
-        // return r
-        return r;
+    standard_index<> hnsw(base_load);
+    start = std::chrono::high_resolution_clock::now();
+    std::vector<float> connectiveness = hnsw.report_neighbor_connection();
+    end = std::chrono::high_resolution_clock::now();
+    float connection_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+    std::string connection_accuracy;
+    for (float f: connectiveness) {
+        connection_accuracy += std::to_string(f) + " ";
     }
+    std::cout << "neighbor connection (s): " << connection_time / 1000 << ", per layer: " << connection_accuracy
+              << std::endl;
 
+    std::fstream file(file_name, std::ios_base::out);
+    file << "queries,k,total_time_for_exact_knn,qps,per_row_qps,agreement,total_time_for_neighbor_connection\n";
+    file << query_load.size() << "," << k << "," << exact_time << "," << qps << "," << naive_qps << ","
+         << agreement << "," << connection_time << "\n";
+    file.close();
+}
 
-    std::vector<std::vector<float> > knn_search(Node *q, int k, int ef) {
+// graph health report of an index of the base, written as json. the first line per layer is the summary
+void diagnostics_benchmark(const vecs_data<float> &base_load, std::string file_name, size_t samples) {
+    standard_index<> hnsw(base_load);
+    graph_diagnostics report = hnsw.diagnose(samples);
+    for (const layer_diagnostics &layer: report.layers) {
+        std::cout << "level " << layer.level << ": nodes: " << layer.nodes << ", mean degree: " << layer.mean_degree
+                  << ", max in-degree: " << layer.max_in_degree << ", in-degree cv: " << layer.in_degree_cv
+                  << ", unreachable: " << layer.unreachable << ", link recall: " << layer.link_recall << std::endl;
+    }
+    std::cout << "diagnostics time (s): " << report.seconds << std::endl;
+    std::fstream file(file_name, std::ios_base::out);
+    report.write_json(file);
+    file.close();
+}
 
-        std::priority_queue<std::pair<float, Node *> > w; // set for the current nearest elements
-        Node *ep = this->enter_point;                     // get enter point for hnsw
-        int l = ep->level;                                // top level for hnsw
-        for (int lc = l; lc > 0; lc--) {
-            w = search_layer(q, ep, 1, lc);
-            Node *p  = w.top().second;
-            if (p == ep) {
-                this->edge_map[p][p][lc]++;
-            }
-            while (p != ep) {
-                this->edge_map[p->parent][p][lc]++;
-                p = p->parent;
-            }
-            ep = w.top().second;
+// mean distance between the ids of linked points at layer 0, what reorder tries to make small
+double mean_link_gap(const HNSW &hnsw) {
+    double gap = 0;
+    size_t links = 0;
+    for (uint32_t i = 0; i < hnsw.size(); i++) {
+        for (uint32_t j: hnsw.get_neighbors(i, 0)) {
+            gap += std::abs((double) j - i);
+            links++;
         }
+    }
+    return links == 0 ? 0 : gap / links;
+}
 
-        // std::vector<float> v1 = knn_search_brute_force(q, graph[1], 1)[0];
-        // set a new node to search layer
-        // ep = this->umap[v1];
-
-        // // compare if 2 vectors are identical
-        // if (v1 == ep->data) {
-        //     this->level_one_hit_count++;
-        // }
-
-        w = search_layer(q, ep, ef, 0);
-
-        std::vector<std::vector<float> > result;
-        while (!w.empty() && result.size() < k) {
-            result.emplace_back(w.top().second->data);
-            Node *p  = w.top().second;
-            if (p == ep) {
-                this->edge_map[p][p][0]++;
+// single-threaded query throughput before and after reorder on the given data, best of 3 rounds. the results
+// after reordering must be the same labels and distances.
+void reorder_run(const std::string &name, const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                 std::fstream &file, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
+    auto best_run = [&]() {
+        query_run best;
+        for (int round = 0; round < 3; round++) {
+            query_run run = run_queries(hnsw, query_load, k, ef_k);
+            if (run.qps > best.qps) {
+                best = std::move(run);
             }
-            while (p != ep) {
-                this->edge_map[p->parent][p][0]++;
-                p = p->parent;
-            }
-            w.pop();
         }
-        return result; // return K nearest elements from W to q
+        return best;
+    };
+    query_run expected = best_run();
+    float qps_before = expected.qps;
+    double gap_before = mean_link_gap(hnsw);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    hnsw.reorder();
+    auto end = std::chrono::high_resolution_clock::now();
+    float reorder_time = (float) duration_cast<std::chrono::microseconds>(end - start).count() / 1000;
+    query_run actual = best_run();
+    float qps_after = actual.qps;
+    double gap_after = mean_link_gap(hnsw);
+
+    bool same = expected.count == actual.count;
+    for (size_t i = 0; same && i < query_load.size(); i++) {
+        for (size_t j = 0; j < expected.count[i]; j++) {
+            same = same && expected.result[i * k + j].label == actual.result[i * k + j].label &&
+                   expected.result[i * k + j].distance == actual.result[i * k + j].distance;
+        }
     }
+    std::cout << name << ": points: " << base_load.size() << ", qps before: " << qps_before << ", qps after: "
+              << qps_after << ", link gap before: " << gap_before << ", link gap after: " << gap_after
+              << ", reorder time (ms): " << reorder_time << ", results: " << (same ? "identical" : "differ")
+              << std::endl;
+    file << name << "," << base_load.size() << "," << qps_before << "," << qps_after << "," << gap_before << ","
+         << gap_after << "," << reorder_time << "," << same << "\n";
+}
 
-    std::vector<std::vector<float> >
-    knn_search_brute_force(const Node *q, const std::vector<Node *> &base_data_nodes, int k) {
-        std::vector<std::vector<float> > base_data;
-        for (const Node * const n : base_data_nodes) {
-            base_data.emplace_back(n->data);
+// reorder on the base and on synthetic clustered data in random order, sized to exceed the last level cache
+void reorder_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                       std::string file_name, int k, int ef_k) {
+    std::fstream file(file_name, std::ios_base::out);
+    file << "data,points,qps_before,qps_after,link_gap_before,link_gap_after,reorder_time,identical_results\n";
+    reorder_run("base", base_load, query_load, file, k, ef_k);
+
+    const size_t synthetic_points = 400000, clusters = 1000, synthetic_queries = 1000;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> center(0, 100);
+    std::normal_distribution<float> noise(0, 5);
+    std::vector<std::vector<float> > centers(clusters, std::vector<float>(base_load.dim()));
+    for (std::vector<float> &c: centers) {
+        for (float &f: c) {
+            f = center(gen);
         }
-        return knn_search_brute_force(q->data, base_data, k);
     }
+    auto sample = [&](size_t n) {
+        std::vector<std::vector<float> > rows(n, std::vector<float>(base_load.dim()));
+        for (std::vector<float> &row: rows) {
+            const std::vector<float> &c = centers[gen() % clusters];
+            for (size_t d = 0; d < row.size(); d++) {
+                row[d] = c[d] + noise(gen);
+            }
+        }
+        return vecs_data<float>::from_rows(rows);
+    };
+    vecs_data<float> synthetic_base = sample(synthetic_points);
+    vecs_data<float> synthetic_query = sample(synthetic_queries);
+    reorder_run("synthetic", synthetic_base, synthetic_query, file, k, ef_k);
+    file.close();
+}
 
-    std::vector<std::vector<float> >
-    knn_search_brute_force(const std::vector<float> &q, const std::vector<std::vector<float> > &base_data, int k) {
-        std::priority_queue<std::pair<float, std::vector<float> > > heap;
-        for (const auto &i: base_data) {
-            float dist = dist_l2(&i, &q);
-            heap.emplace(dist, i);
-            if (heap.size() > k) {
-                heap.pop();
+// cost of query profiling: the queries are answered single-threaded in rounds alternating profiling off and on,
+// the median round of each is compared. the profile of the last ef is printed and saved as json.
+void profile_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &query_load,
+                       std::string file_name, std::string json_name, int k, const std::vector<int> &efs) {
+    standard_index<> hnsw(base_load);
+
+    const int rounds = 7;
+    std::fstream file(file_name, std::ios_base::out);
+    file << "ef,qps_off,qps_on,overhead,latency_p50_us,latency_p90_us,latency_p99_us,latency_p999_us,"
+         << "distances_p50,distances_p99,hops_p50,hops_p99\n";
+    search_context ctx;
+    std::vector<search_result> result(k);
+    for (int ef: efs) {
+        auto run = [&]() {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < query_load.size(); i++) {
+                hnsw.knn_search(ctx, query_load[i], k, ef, result.data());
             }
+            auto end = std::chrono::high_resolution_clock::now();
+            hnsw.merge_stats(ctx);
+            return (double) duration_cast<std::chrono::nanoseconds>(end - start).count();
+        };
+        std::vector<double> off, on;
+        for (int r = 0; r < rounds; r++) {
+            hnsw.set_profiling(false);
+            off.push_back(run());
+            hnsw.set_profiling(true);
+            on.push_back(run());
         }
-        std::vector<std::vector<float> > result;
-        while (!heap.empty()) {
-            result.emplace_back(heap.top().second);
-            heap.pop();
+        query_profile profile = hnsw.get_query_profile();    // last round only, set_profiling clears it
+        hnsw.set_profiling(false);
+        std::sort(off.begin(), off.end());
+        std::sort(on.begin(), on.end());
+        double qps_off = query_load.size() / (off[rounds / 2] / 1e9);
+        double qps_on = query_load.size() / (on[rounds / 2] / 1e9);
+        double overhead = qps_off / qps_on - 1;
+
+        std::cout << "ef: " << ef << ", qps off: " << qps_off << ", qps on: " << qps_on << ", overhead: "
+                  << overhead * 100 << "%, latency us p50: " << profile.latency_ns.percentile(0.5) / 1000.0
+                  << ", p90: " << profile.latency_ns.percentile(0.9) / 1000.0 << ", p99: "
+                  << profile.latency_ns.percentile(0.99) / 1000.0 << ", p999: "
+                  << profile.latency_ns.percentile(0.999) / 1000.0 << std::endl;
+        for (size_t lc = 0; lc < profile.layers.size(); lc++) {
+            const layer_counters &layer = profile.layers[lc];
+            std::cout << "  level " << lc << ": hops: " << (double) layer.hops / profile.queries << ", distances: "
+                      << (double) layer.distances / profile.queries << ", visited: "
+                      << (double) layer.visited / profile.queries << ", heap operations: "
+                      << (double) layer.heap_operations / profile.queries << std::endl;
+        }
+        file << ef << "," << qps_off << "," << qps_on << "," << overhead << ","
+             << profile.latency_ns.percentile(0.5) / 1000.0 << "," << profile.latency_ns.percentile(0.9) / 1000.0
+             << "," << profile.latency_ns.percentile(0.99) / 1000.0 << ","
+             << profile.latency_ns.percentile(0.999) / 1000.0 << "," << profile.distances.percentile(0.5) << ","
+             << profile.distances.percentile(0.99) << "," << profile.hops.percentile(0.5) << ","
+             << profile.hops.percentile(0.99) << "\n";
+        if (ef == efs.back()) {
+            std::fstream json(json_name, std::ios_base::out);
+            profile.write_json(json);
+            json.close();
         }
-        return result;
     }
-};
-
-void load_fvecs_data(const char *filename,
-                     std::vector<std::vector<float> > &results, unsigned &num, unsigned &dim) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in.is_open()) {
-        std::cout << "open file error" << std::endl;
-        exit(-1);
-    }
-    in.read((char *) &dim, 4);
-    in.seekg(0, std::ios::end);
-    std::ios::pos_type ss = in.tellg();
-    size_t fsize = (size_t) ss;
-    num = (unsigned) (fsize / (dim + 1) / 4);
-    // initialize results
-    results.resize(num);
-    for (unsigned i = 0; i < num; i++)
-        results[i].resize(dim);
-
-    in.seekg(0, std::ios::beg);
-    for (size_t i = 0; i < num; i++) {
-        in.seekg(4, std::ios::cur);
-        float tmp[dim];
-        in.read((char *) tmp, dim * 4);
-        for (unsigned j = 0; j < dim; j++) {
-            results[i][j] = (float) tmp[j];
-        }
-    }
-    in.close();
-}
-
-void load_ivecs_data(const char *filename,
-                     std::vector<std::vector<float> > &results, unsigned &num, unsigned &dim) {
-    std::ifstream in(filename, std::ios::binary);
-    if (!in.is_open()) {
-        std::cout << "open file error" << std::endl;
-        exit(-1);
-    }
-    in.read((char *) &dim, 4);
-    in.seekg(0, std::ios::end);
-    std::ios::pos_type ss = in.tellg();
-    size_t fsize = (size_t) ss;
-    num = (unsigned) (fsize / (dim + 1) / 4);
-    // initialize results
-    results.resize(num);
-    for (unsigned i = 0; i < num; i++)
-        results[i].resize(dim);
-
-    in.seekg(0, std::ios::beg);
-    for (size_t i = 0; i < num; i++) {
-        in.seekg(4, std::ios::cur);
-        int tmp[dim];
-        in.read((char *) tmp, dim * 4);
-        for (unsigned j = 0; j < dim; j++) {
-            results[i][j] = (int) tmp[j];
-        }
-    }
-    in.close();
+    file.close();
 }
 
-void load_txt_data(const char* filename, std::vector<std::vector<float> > &results, unsigned &num, unsigned &dim) {
-    std::ifstream fd(filename);
-    if (!fd.is_open()) {
-        std::cout << "open file error" << std::endl;
-        exit(-1);
-    }
-    std::string temp;
-    while (getline(fd, temp)) {
-        vector<float> f;
-        // split the line by space
-        std::istringstream iss(temp);
-        std::string token;
-        while (getline(iss, token, ' ')) {
-            f.push_back(stof(token));
+// fixed ef against the adaptive stopping rule: for every target recall both are calibrated on the learn set, then
+// the queries are answered with each and their recall and distance count compared
+void adaptive_benchmark(const vecs_data<float> &base_load, const vecs_data<float> &learn_load,
+                        const vecs_data<float> &query_load, const vecs_data<int32_t> &groundtruth_load,
+                        std::string file_name, const std::vector<int> &ks, const std::vector<double> &targets) {
+    standard_index<> hnsw(base_load);
+
+    std::fstream file(file_name, std::ios_base::out);
+    file << "k,target_recall,ef,fixed_recall,fixed_distances,patience,ef_max,adaptive_recall,adaptive_distances,"
+         << "distance_reduction\n";
+    for (int k: ks) {
+        for (double target: targets) {
+            int ef = hnsw.calibrate_ef(learn_load, k, target);
+            hnsw.calibrate_adaptive(learn_load, k, target);
+            auto [patience, ef_max] = hnsw.get_adaptive_search();
+
+            std::vector<search_result> query_result(query_load.size() * k);
+            std::vector<size_t> result_count(query_load.size());
+            auto run = [&](bool adaptive) {
+                search_context ctx;
+                for (size_t i = 0; i < query_load.size(); i++) {
+                    search_result *result = query_result.data() + i * k;
+                    result_count[i] = adaptive ? hnsw.knn_search_adaptive(ctx, query_load[i], k, result)
+                                               : hnsw.knn_search(ctx, query_load[i], k, ef, result);
+                }
+                float recall = average_recall(query_result, result_count, k, query_load, groundtruth_load, hnsw);
+                return std::make_pair(recall, (double) ctx.stats.distance_calculation_count / query_load.size());
+            };
+            auto [fixed_recall, fixed_distances] = run(false);
+            auto [adaptive_recall, adaptive_distances] = run(true);
+            double reduction = 1 - adaptive_distances / fixed_distances;
+
+            std::cout << "k: " << k << ", target: " << target << ", ef: " << ef << ", recall: " << fixed_recall
+                      << ", distances: " << fixed_distances << " | patience: " << patience << ", recall: "
+                      << adaptive_recall << ", distances: " << adaptive_distances << ", reduction: "
+                      << reduction * 100 << "%" << std::endl;
+            file << k << "," << target << "," << ef << "," << fixed_recall << "," << fixed_distances << ","
+                 << patience << "," << ef_max << "," << adaptive_recall << "," << adaptive_distances << ","
+                 << reduction << "\n";
         }
-        results.push_back(f);
     }
+    file.close();
+}
 
-    num = results.size();
-    dim = results[0].size();
-    fd.close();
+// builds an index specialized on Metric and checks its recall against a brute force search with the same metric
+// on the first queries. returns false when the recall is below min_recall.
+template<typename Metric>
+bool metric_recall(const vecs_data<float> &base_load, const vecs_data<float> &query_load, int k, int ef_k,
+                   float min_recall) {
+    standard_index<Metric> hnsw(base_load);
+
+    vecs_data<float> queries = query_load.slice(0, std::min(query_load.size(), (size_t) 1000));
+    query_run run = run_queries(hnsw, queries, k, ef_k);
+    float avg_recall = average_recall(run.result, run.count, k, queries, vecs_data<int32_t>(), hnsw);
+    std::cout << "metric: " << Metric::name << ", qps: " << run.qps << ", recall: " << avg_recall << std::endl;
+    return avg_recall >= min_recall;
 }
 
+// saves a built index, opens it again both read into memory and memory-mapped, and checks that every query
+// returns exactly the same labels and distances as the original index
+bool save_load_round_trip(const vecs_data<float> &base_load,
+                          const vecs_data<float> &query_load,
+                          std::string index_file, int k, int ef_k) {
+    standard_index<> hnsw(base_load);
 
-void
-build_graph_and_query(const std::vector<std::vector<float> > &base_load,
-                      const std::vector<std::vector<float> > &learn_load,
-                      const std::vector<std::vector<float> > &query_load,
-                      const std::vector<std::vector<float> > &groundtruth_load,
-                      std::string file_name, HNSW &hnsw, int k, int ef_k) {
-    // initialize graph
     auto start = std::chrono::high_resolution_clock::now();
-    hnsw.build_graph(base_load);
-    hnsw.print_graph_parameters();
+    hnsw.save(index_file);
     auto end = std::chrono::high_resolution_clock::now();
-    auto duration = duration_cast<std::chrono::milliseconds>(end - start);
-    float build_time = (float) duration.count();
-    auto build_count = hnsw.get_distance_calculation_count();
-    std::cout << "total time for building graph: " << build_time / 1000 << std::endl;
-    std::cout << "total distance count for building graph: " << build_count << std::endl;
-
-    // learn
-    for (const std::vector<float> &v: learn_load) {
-        Node *query_node = new Node(v, std::vector<std::vector<Node *> >(), 0);
-        hnsw.knn_search(query_node, k, ef_k);
-        delete query_node;
-    }
-
-    // base
-    for (const std::vector<float> &v: base_load) {
-        Node *query_node = new Node(v, std::vector<std::vector<Node *> >(), 0);
-        hnsw.knn_search(query_node, k, ef_k);
-        delete query_node;
-    }
+    std::cout << "save time (ms): " << duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0
+              << std::endl;
 
-    // query
+    HNSW loaded = HNSW(0, 0, 0, 0, 0, "");
     start = std::chrono::high_resolution_clock::now();
-    hnsw.set_distance_calculation_count(0);
-    std::vector<std::vector<std::vector<float> > > query_result;
-    for (const std::vector<float> &v: query_load) {
-        Node *query_node = new Node(v, std::vector<std::vector<Node *> >(), 0);
-        query_result.emplace_back(hnsw.knn_search(query_node, k, ef_k));
-        delete query_node;
-    }
+    loaded.load(index_file);
     end = std::chrono::high_resolution_clock::now();
-    duration = duration_cast<std::chrono::milliseconds>(end - start);
-    float query_time = (float) duration.count();
-    auto query_count = hnsw.get_distance_calculation_count();
-    std::cout << "total time for query: " << query_time / 1000 << std::endl;
-    std::cout << "total distance count for query: " << query_count << std::endl;
+    std::cout << "load time (ms): " << duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0
+              << std::endl;
 
-    // frequency distribution
-    int non_zero_count = 0;
-    int zero_count = 0;
-    for (int l = 0; l < hnsw.graph.size(); l++) {
-        std::cout << "level " << l << std::endl;
-        int count = 0;
-        for (Node *a : hnsw.graph[l]) {
-            std::cout << "node " << a << ": ";
-            std::cout <<hnsw.edge_map[a][a][l] << " | ";
-            count += hnsw.edge_map[a][a][l];
-            for (Node *b: a->neighbors[l]) {
-                non_zero_count++;
-                if (hnsw.edge_map[a][b][l] == 0) {
-                    zero_count++;
+    HNSW mapped = HNSW(0, 0, 0, 0, 0, "");
+    start = std::chrono::high_resolution_clock::now();
+    mapped.load(index_file, true, false);
+    end = std::chrono::high_resolution_clock::now();
+    std::cout << "mmap open time (ms): " << duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0
+              << std::endl;
+
+    std::vector<search_result> expected(k), actual(k);
+    for (size_t q = 0; q < query_load.size(); q++) {
+        size_t count = hnsw.knn_search(query_load[q], k, ef_k, expected.data());
+        for (HNSW *index: {&loaded, &mapped}) {
+            if (index->knn_search(query_load[q], k, ef_k, actual.data()) != count) {
+                return false;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (actual[i].label != expected[i].label || actual[i].distance != expected[i].distance) {
+                    return false;
                 }
-                std::cout << hnsw.edge_map[a][b][l] << " ";
-                count += hnsw.edge_map[a][b][l];
             }
-            std::cout << std::endl;
-        }
-        std::cout << "level " << l << " total count: " << count << std::endl;
-    }
-    std::cout << "non_zero_count: " << non_zero_count << std::endl;
-    std::cout << "zero_count: " << zero_count << std::endl;
-
-    // calculate recall
-    std::vector<float> total_recall;
-    for (int i = 0; i < query_load.size(); i++) {
-        if (groundtruth_load.size() != 0) {
-            total_recall.emplace_back(calculate_recall(query_result[i], base_load, groundtruth_load[i]));
-        } else {
-            total_recall.emplace_back(
-                    calculate_recall(query_result[i], hnsw.knn_search_brute_force(query_load[i], base_load, 100)));
         }
     }
-    float avg_recall = std::accumulate(total_recall.begin(), total_recall.end(), 0.0) / total_recall.size();
-    std::cout << "recall: " << avg_recall << std::endl;
-
-    // level one hit rate
-    float level_one_hit_rate = (float) hnsw.get_level_one_hit_count() / query_load.size();
-    std::cout << "level_one_hit_count: " << level_one_hit_rate << std::endl;
-
-    // report neighbor connection
-    // std::vector<float> connectiveness = hnsw.report_neighbor_connection();
-    std::vector<float> connectiveness;
-    std::string connection_accuracy;
-    for (float f : connectiveness) {
-        connection_accuracy += std::to_string(f) + " ";
-    }
-
-    // write to csv file
-    std::fstream file(file_name, std::ios_base::app);
-    auto p = hnsw.get_graph_parameters();
-    int m, m_max, m_max_0, ef_construction;
-    float ml;
-    std::string select_neighbors_mode;
-    std::tie(m, m_max, m_max_0, ef_construction, ml, select_neighbors_mode) = p;
-    file << m << "," << m_max << "," << m_max_0 << "," << ef_construction << "," << ml << ","
-         << select_neighbors_mode << ","
-         << build_time << "," << query_time << "," << build_count << "," << query_count << "," << avg_recall << ","
-         << connection_accuracy << "," << k << "," << ef_k << "," << level_one_hit_rate << "\n";
-    file.close();
+    return true;
 }
 
-
-
 int main(int argc, char **argv) {
     srand(42);
-    // load dataset
-    std::vector<std::vector<float> > base_load;
-    std::vector<std::vector<float> > query_load;
-    std::vector<std::vector<float> > learn_load;
-    std::vector<std::vector<float> > groundtruth_load;
-    unsigned dim1, num1;
-    unsigned dim2, num2;
-    unsigned dim3, num3;
-    unsigned dim4, num4;
-    load_fvecs_data("sift/sift_base.fvecs", base_load, num1, dim1);
-    load_fvecs_data("sift/sift_learn.fvecs", learn_load, num2, dim2);
-    load_fvecs_data("sift/sift_query.fvecs", query_load, num3, dim3);
-    load_ivecs_data("sift/sift_groundtruth.ivecs", groundtruth_load, num4, dim4);
+    // load dataset, vecs files are memory-mapped so only the pages touched get read
+    vecs_data<float> base_load, learn_load, query_load;
+    vecs_data<int32_t> groundtruth_load;
+    try {
+        auto start = std::chrono::high_resolution_clock::now();
+        base_load = load_fvecs_data("sift/sift_base.fvecs");
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "base load time (ms): " << duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0
+                  << std::endl;
+        learn_load = load_fvecs_data("sift/sift_learn.fvecs");
+        query_load = load_fvecs_data("sift/sift_query.fvecs");
+        groundtruth_load = load_ivecs_data("sift/sift_groundtruth.ivecs");
 //
-//     load_txt_data("glovesmall/glovesmall.twitter.27B.25d.base.txt", base_load, num1, dim1);
-//     load_txt_data("glovesmall/glovesmall.twitter.27B.25d.query.txt", query_load, num2, dim2);
-//     load_txt_data("glovesmall/glovesmall.twitter.27B.25d.groundtruth.txt", groundtruth_load, num3, dim3);
-
-    std::cout << "base_num：" << num1 << std::endl
-              << "base dimension：" << dim1 << std::endl;
-    std::cout << "learn_num：" << num2 << std::endl
-              << "learn dimension：" << dim2 << std::endl;
-    std::cout << "query_num：" << num3 << std::endl
-              << "query dimension：" << dim3 << std::endl;
-    std::cout << "groundtruth_num：" << num4 << std::endl
-              << "groundtruth dimension：" << dim4 << std::endl;
+//        base_load = load_txt_data("glovesmall/glovesmall.twitter.27B.25d.base.txt");
+//        query_load = load_txt_data("glovesmall/glovesmall.twitter.27B.25d.query.txt");
+//        groundtruth_load = load_txt_data<int32_t>("glovesmall/glovesmall.twitter.27B.25d.groundtruth.txt");
+    } catch (const std::exception &e) {
+        std::cout << "load error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "base_num：" << base_load.size() << std::endl
+              << "base dimension：" << base_load.dim() << std::endl;
+    std::cout << "learn_num：" << learn_load.size() << std::endl
+              << "learn dimension：" << learn_load.dim() << std::endl;
+    std::cout << "query_num：" << query_load.size() << std::endl
+              << "query dimension：" << query_load.dim() << std::endl;
+    std::cout << "groundtruth_num：" << groundtruth_load.size() << std::endl
+              << "groundtruth dimension：" << groundtruth_load.dim() << std::endl;
+
+    if (argc > 1 && std::string(argv[1]) == "build_scaling") {
+        build_thread_scaling(base_load, query_load, groundtruth_load, "build_scaling.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "round_trip") {
+        bool same = save_load_round_trip(base_load, query_load, "sift.hnsw", 100, 1000);
+        std::cout << "round trip: " << (same ? "identical results" : "results differ") << std::endl;
+        return same ? 0 : 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "quantization") {
+        quantization_benchmark(base_load, query_load, groundtruth_load, "quantization.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "pq") {
+        pq_benchmark(base_load, learn_load, query_load, groundtruth_load, "pq.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "metrics") {
+        bool ok = metric_recall<metric_l2>(base_load, query_load, 10, 1000, 0.9);
+        ok = metric_recall<metric_ip>(base_load, query_load, 10, 1000, 0.9) && ok;
+        ok = metric_recall<metric_cosine>(base_load, query_load, 10, 1000, 0.9) && ok;
+        std::cout << "metrics: " << (ok ? "recall ok" : "recall too low") << std::endl;
+        return ok ? 0 : 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "batch") {
+        batch_benchmark(base_load, query_load, groundtruth_load, "batch.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "delete") {
+        delete_benchmark(base_load, query_load, "delete.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "stream") {
+        stream_benchmark(base_load, query_load, groundtruth_load, "stream.csv", 100, 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "filter") {
+        filter_benchmark(base_load, query_load, "filter.csv", 10, 100);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "range") {
+        range_benchmark(base_load, query_load, "range.csv");
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "groundtruth") {
+        groundtruth_benchmark(base_load, query_load, groundtruth_load, "groundtruth.csv", "groundtruth.ivecs", 100);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "diagnostics") {
+        diagnostics_benchmark(base_load, "diagnostics.json", 1000);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "reorder") {
+        reorder_benchmark(base_load, query_load, "reorder.csv", 10, 100);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "profile") {
+        profile_benchmark(base_load, learn_load.size() > 0 ? learn_load : query_load, "profile.csv", "profile.json",
+                          10, {10, 40, 160});
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "adaptive") {
+        adaptive_benchmark(base_load, learn_load, query_load, groundtruth_load, "adaptive.csv", {10, 100},
+                           {0.9, 0.95, 0.99});
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "query_scaling") {
+        query_thread_scaling(base_load, query_load, groundtruth_load, "query_scaling.csv", 100, 1000);
+        return 0;
+    }
 
     // prepare csv file to write
     std::string file_name = "test.csv";
     std::fstream output_file(file_name, std::ios_base::out);
     output_file << "m,m_max,m_max_0,ef_construction,ml,select_neighbor_mode,"
                 << "total_time_for_building_graph,total_time_for_query,total_distance_count_for_building_graph,total_distance_count_for_query,"
-                << "recall,k,ef_k,level_one_hit_rate\n";
+                << "recall,connection_accuracy,k,ef_k,level_one_hit_rate,"
+                << "latency_p50_us,latency_p99_us,latency_p999_us\n";
     output_file.close();
 
-    // for (std::string select_neighbors_mode: {"simple", "heuristic"}) {
-    //     for (int m = 10; m < 25; m += 5) {
-    //         for (int m_max = 10; m_max < 45; m_max += 5) {
-    //             for (int m_max_0 = 10; m_max_0 < 50; m_max_0 += 5) {
-    //                 for (int ef_construction = m; ef_construction < 120; ef_construction += 20) {
-    //                     build_graph_and_query(base_load, query_load, groundtruth_load, file_name, m, m_max, m_max_0,
-    //                                           ef_construction, 1.0, select_neighbors_mode, 100, 100);
-    //                 }
-    //             }
-    //         }
-    //     }
-    // }
+    // parameter sweeps are run by the bench target, see bench.conf
     HNSW hnsw = HNSW(16, 16, 32, 32, 1.0, "simple");
     build_graph_and_query(base_load, learn_load, query_load, groundtruth_load, file_name, hnsw, 100, 1000);
 
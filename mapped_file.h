@@ -0,0 +1,69 @@
+#ifndef UNTITLED_MAPPED_FILE_H
+#define UNTITLED_MAPPED_FILE_H
+
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// read-only view of a whole file through mmap. pages are private copy-on-write, so callers may patch the
+// mapping in memory without ever touching the file.
+class mapped_file {
+private:
+    char *addr = nullptr;
+    size_t length = 0;
+
+public:
+    explicit mapped_file(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("mapped_file: cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat st{};
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("mapped_file: cannot stat " + path + ": " + std::strerror(errno));
+        }
+        length = (size_t) st.st_size;
+        if (length > 0) {
+            void *p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("mapped_file: cannot map " + path + ": " + std::strerror(errno));
+            }
+            addr = static_cast<char *>(p);
+        }
+        ::close(fd);
+    }
+
+    ~mapped_file() {
+        if (addr != nullptr) {
+            ::munmap(addr, length);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    char *data() const {
+        return addr;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // hint the kernel that pages are touched in no particular order, which stops readahead
+    void advise_random() const {
+        if (addr != nullptr) {
+            ::madvise(addr, length, MADV_RANDOM);
+        }
+    }
+};
+
+#endif //UNTITLED_MAPPED_FILE_H
@@ -0,0 +1,59 @@
+#ifndef UNTITLED_PARALLEL_H
+#define UNTITLED_PARALLEL_H
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline size_t resolve_num_threads(size_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    return num_threads == 0 ? 1 : num_threads;
+}
+
+// runs fn(i, thread_id) for every i in [start, end) on num_threads threads (0 = all cores).
+// items are handed out one at a time so uneven work balances itself, the first exception is rethrown.
+template<typename Function>
+void parallel_for(size_t start, size_t end, size_t num_threads, Function fn) {
+    num_threads = resolve_num_threads(num_threads);
+    if (num_threads == 1 || end - start <= 1) {
+        for (size_t i = start; i < end; i++) {
+            fn(i, 0);
+        }
+        return;
+    }
+
+    std::atomic<size_t> current(start);
+    std::exception_ptr last_exception = nullptr;
+    std::mutex exception_lock;
+    std::vector<std::thread> threads;
+    for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
+        threads.emplace_back([&, thread_id] {
+            while (true) {
+                size_t i = current.fetch_add(1);
+                if (i >= end) {
+                    break;
+                }
+                try {
+                    fn(i, thread_id);
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(exception_lock);
+                    last_exception = std::current_exception();
+                    current = end; // stop handing out work
+                    break;
+                }
+            }
+        });
+    }
+    for (std::thread &t: threads) {
+        t.join();
+    }
+    if (last_exception) {
+        std::rethrow_exception(last_exception);
+    }
+}
+
+#endif //UNTITLED_PARALLEL_H
@@ -0,0 +1,249 @@
+#ifndef UNTITLED_PQ_H
+#define UNTITLED_PQ_H
+
+#include <vector>
+#include <random>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include "distance.h"
+#include "parallel.h"
+
+// sum of table[j * 256 + code[j]] over the m sub-quantizers
+typedef float (*adc_func_t)(const float *, const uint8_t *, size_t);
+
+inline float pq_adc_scalar(const float *table, const uint8_t *code, size_t m) {
+    float dist0 = 0, dist1 = 0;
+    size_t j = 0;
+    for (; j + 2 <= m; j += 2) {
+        dist0 += table[j * 256 + code[j]];
+        dist1 += table[(j + 1) * 256 + code[j + 1]];
+    }
+    if (j < m) {
+        dist0 += table[j * 256 + code[j]];
+    }
+    return dist0 + dist1;
+}
+
+#ifdef HNSW_X86
+
+__attribute__((target("avx2")))
+inline float pq_adc_avx2(const float *table, const uint8_t *code, size_t m) {
+    const __m256i offsets = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    __m256 sum = _mm256_setzero_ps();
+    size_t j = 0;
+    for (; j + 8 <= m; j += 8) {
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + j)));
+        sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + j * 256, _mm256_add_epi32(c, offsets), 4));
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float dist = _mm_cvtss_f32(s);
+    for (; j < m; j++) {
+        dist += table[j * 256 + code[j]];
+    }
+    return dist;
+}
+
+__attribute__((target("avx512f")))
+inline float pq_adc_avx512(const float *table, const uint8_t *code, size_t m) {
+    const __m512i offsets = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792, 2048, 2304, 2560, 2816,
+                                              3072, 3328, 3584, 3840);
+    __m512 sum = _mm512_setzero_ps();
+    size_t j = 0;
+    for (; j + 16 <= m; j += 16) {
+        __m512i c = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code + j)));
+        sum = _mm512_add_ps(sum, _mm512_i32gather_ps(_mm512_add_epi32(c, offsets), table + j * 256, 4));
+    }
+    float dist = _mm512_reduce_add_ps(sum);
+    for (; j < m; j++) {
+        dist += table[j * 256 + code[j]];
+    }
+    return dist;
+}
+
+#endif
+
+// gathers are only worth it from avx2 on, the other levels use the scalar loop
+inline adc_func_t get_pq_adc(simd_level level = cpu_simd_level()) {
+    switch (level) {
+#ifdef HNSW_X86
+        case simd_level::avx512:
+            return pq_adc_avx512;
+        case simd_level::avx2:
+            return pq_adc_avx2;
+#endif
+        default:
+            return pq_adc_scalar;
+    }
+}
+
+// product quantizer: a vector is split into m sub-vectors of dim / m floats, each stored as the byte index of
+// the nearest of 256 centroids trained with k-means on that sub-space. the distance of a query to a code is
+// the sum of m lookups in a table of query to centroid distances computed once per query.
+class product_quantizer {
+public:
+    static constexpr size_t CENTROIDS = 256;
+
+private:
+    size_t dim = 0;
+    size_t m = 0;
+    size_t dsub = 0;
+    std::vector<float> centroids;                // [m][CENTROIDS][dsub]
+    dist_func_t l2_sqr = nullptr;
+    adc_func_t adc = nullptr;
+
+    const float *get_centroid(size_t j, size_t c) const {
+        return centroids.data() + (j * CENTROIDS + c) * dsub;
+    }
+
+    // index of the centroid of sub-space j nearest to the sub-vector x
+    uint8_t nearest_centroid(size_t j, const float *x) const {
+        size_t best = 0;
+        float best_dist = l2_sqr(x, get_centroid(j, 0), dsub);
+        for (size_t c = 1; c < CENTROIDS; c++) {
+            float d = l2_sqr(x, get_centroid(j, c), dsub);
+            if (d < best_dist) {
+                best_dist = d;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    // lloyd iterations on the n rows of x (dsub floats each), result in the CENTROIDS centroids of sub-space j
+    void kmeans(size_t j, const std::vector<float> &x, size_t n, int iterations, std::mt19937 &rng,
+                size_t num_threads) {
+        float *cent = centroids.data() + j * CENTROIDS * dsub;
+        std::vector<size_t> perm(n);
+        std::iota(perm.begin(), perm.end(), 0);
+        std::shuffle(perm.begin(), perm.end(), rng);
+        for (size_t c = 0; c < CENTROIDS; c++) {
+            std::copy(x.begin() + perm[c] * dsub, x.begin() + (perm[c] + 1) * dsub, cent + c * dsub);
+        }
+
+        const size_t block = 1024;
+        std::vector<uint8_t> assign(n);
+        std::vector<float> sums(CENTROIDS * dsub);
+        std::vector<size_t> counts(CENTROIDS);
+        for (int it = 0; it < iterations; it++) {
+            parallel_for(0, (n + block - 1) / block, num_threads, [&](size_t b, size_t) {
+                for (size_t i = b * block; i < std::min(n, (b + 1) * block); i++) {
+                    assign[i] = nearest_centroid(j, x.data() + i * dsub);
+                }
+            });
+            std::fill(sums.begin(), sums.end(), 0);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < n; i++) {
+                counts[assign[i]]++;
+                for (size_t d = 0; d < dsub; d++) {
+                    sums[assign[i] * dsub + d] += x[i * dsub + d];
+                }
+            }
+            for (size_t c = 0; c < CENTROIDS; c++) {
+                if (counts[c] == 0) {
+                    continue;
+                }
+                for (size_t d = 0; d < dsub; d++) {
+                    cent[c * dsub + d] = sums[c * dsub + d] / counts[c];
+                }
+            }
+            // an empty cluster takes half of the largest one: both get a slightly moved copy of its centroid
+            for (size_t c = 0; c < CENTROIDS; c++) {
+                if (counts[c] != 0) {
+                    continue;
+                }
+                size_t largest = std::max_element(counts.begin(), counts.end()) - counts.begin();
+                for (size_t d = 0; d < dsub; d++) {
+                    float v = cent[largest * dsub + d];
+                    float eps = (d % 2 == 0 ? 1 : -1) * (std::abs(v) + 1e-3f) / 1024;
+                    cent[c * dsub + d] = v + eps;
+                    cent[largest * dsub + d] = v - eps;
+                }
+                counts[c] = counts[largest] / 2;
+                counts[largest] -= counts[c];
+            }
+        }
+    }
+
+public:
+    bool is_trained() const {
+        return !centroids.empty();
+    }
+
+    // bytes of one code
+    size_t code_size() const {
+        return m;
+    }
+
+    size_t table_size() const {
+        return m * CENTROIDS;
+    }
+
+    size_t memory_usage() const {
+        return centroids.size() * sizeof(float);
+    }
+
+    // trains m codebooks on at most max_points rows of source, any row source with size(), dim() and
+    // read_row(i, float *out). m must divide the dimension, 256 rows at least are needed.
+    template<typename Source>
+    void train(const Source &source, size_t m, int iterations = 25, size_t max_points = 65536,
+               size_t num_threads = 1) {
+        if (m == 0 || source.dim() % m != 0) {
+            throw std::runtime_error("product_quantizer: m = " + std::to_string(m) + " does not divide dim = " +
+                                     std::to_string(source.dim()));
+        }
+        if (source.size() < CENTROIDS) {
+            throw std::runtime_error("product_quantizer: at least 256 training vectors are needed");
+        }
+        this->dim = source.dim();
+        this->m = m;
+        this->dsub = dim / m;
+        this->l2_sqr = get_l2_sqr(dsub);
+        this->adc = get_pq_adc();
+        centroids.assign(m * CENTROIDS * dsub, 0);
+
+        // evenly spaced sample of the training rows
+        size_t n = std::min(source.size(), max_points);
+        std::vector<float> sample(n * dim);
+        for (size_t i = 0; i < n; i++) {
+            source.read_row(i * source.size() / n, sample.data() + i * dim);
+        }
+
+        std::mt19937 rng(1234);
+        std::vector<float> x(n * dsub);
+        for (size_t j = 0; j < m; j++) {
+            for (size_t i = 0; i < n; i++) {
+                std::copy(sample.begin() + i * dim + j * dsub, sample.begin() + i * dim + (j + 1) * dsub,
+                          x.begin() + i * dsub);
+            }
+            kmeans(j, x, n, iterations, rng, num_threads);
+        }
+    }
+
+    void encode(const float *v, uint8_t *code) const {
+        for (size_t j = 0; j < m; j++) {
+            code[j] = nearest_centroid(j, v + j * dsub);
+        }
+    }
+
+    // table[j * 256 + c] = squared distance of the j-th sub-vector of q to centroid c
+    void compute_table(const float *q, float *table) const {
+        for (size_t j = 0; j < m; j++) {
+            for (size_t c = 0; c < CENTROIDS; c++) {
+                table[j * CENTROIDS + c] = l2_sqr(q + j * dsub, get_centroid(j, c), dsub);
+            }
+        }
+    }
+
+    float distance(const float *table, const uint8_t *code) const {
+        return adc(table, code, m);
+    }
+};
+
+#endif //UNTITLED_PQ_H
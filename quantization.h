@@ -0,0 +1,351 @@
+#ifndef UNTITLED_QUANTIZATION_H
+#define UNTITLED_QUANTIZATION_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "distance.h"
+
+// how the index stores the vectors it traverses. fp32 is exact, the compressed modes keep one code per
+// vector and compare the fp32 query against the code (asymmetric distance), see HNSW::quantize.
+// pq codes come from a trained product_quantizer (pq.h), see HNSW::quantize_pq
+enum class storage_type {
+    fp32, fp16, int8, pq
+};
+
+inline const char *storage_type_name(storage_type type) {
+    switch (type) {
+        case storage_type::fp16:
+            return "fp16";
+        case storage_type::int8:
+            return "int8";
+        case storage_type::pq:
+            return "pq";
+        default:
+            return "fp32";
+    }
+}
+
+// bytes of one code, the size of pq codes depends on the quantizer and is not known here
+inline size_t code_size(storage_type type, size_t dim) {
+    switch (type) {
+        case storage_type::fp16:
+            return dim * sizeof(uint16_t);
+        case storage_type::int8:
+            return dim * sizeof(uint8_t);
+        case storage_type::pq:
+            return 0;
+        default:
+            return dim * sizeof(float);
+    }
+}
+
+// squared l2 distance between an fp32 query and a code. params holds what the decoder needs:
+// for int8 the per-dimension minimum followed by the per-dimension step, unused for fp16
+typedef float (*code_dist_func_t)(const float *, const uint8_t *, const float *, size_t);
+
+// ieee half precision conversions, used to encode and by the scalar kernel
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exponent = (int32_t) ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+    if (((x >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0); // inf, nan
+    }
+    if (exponent >= 31) {
+        return sign | 0x7c00; // overflow
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign; // underflow
+        }
+        // subnormal, round to nearest even
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++; // may carry into the exponent, which is still correct
+    }
+    return half;
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0x1f) {
+        x = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        x = sign;
+    } else {
+        // subnormal half, normalize
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// int8 codes store round((x - min) / step) per dimension, params = [min[dim], step[dim]]
+inline void sq8_train(const float *vectors, size_t n, size_t dim, float *params) {
+    float *min = params;
+    float *step = params + dim;
+    for (size_t j = 0; j < dim; j++) {
+        min[j] = n == 0 ? 0 : vectors[j];
+        step[j] = n == 0 ? 0 : vectors[j];
+    }
+    for (size_t i = 1; i < n; i++) {
+        for (size_t j = 0; j < dim; j++) {
+            min[j] = std::min(min[j], vectors[i * dim + j]);
+            step[j] = std::max(step[j], vectors[i * dim + j]);
+        }
+    }
+    for (size_t j = 0; j < dim; j++) {
+        step[j] = (step[j] - min[j]) / 255;
+        if (step[j] == 0) {
+            step[j] = 1; // constant dimension, every code is 0
+        }
+    }
+}
+
+inline void sq8_encode(const float *v, size_t dim, const float *params, uint8_t *code) {
+    for (size_t j = 0; j < dim; j++) {
+        float c = std::round((v[j] - params[j]) / params[dim + j]);
+        code[j] = (uint8_t) std::clamp(c, 0.0f, 255.0f);
+    }
+}
+
+inline void fp16_encode(const float *v, size_t dim, uint8_t *code) {
+    for (size_t j = 0; j < dim; j++) {
+        uint16_t h = float_to_half(v[j]);
+        std::memcpy(code + j * sizeof(uint16_t), &h, sizeof(uint16_t));
+    }
+}
+
+template<size_t D>
+float sq8_l2_sqr_scalar(const float *q, const uint8_t *code, const float *params, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const float *min = params;
+    const float *step = params + n;
+    float dist = 0;
+    for (size_t i = 0; i < n; i++) {
+        float d = q[i] - (min[i] + step[i] * code[i]);
+        dist += d * d;
+    }
+    return dist;
+}
+
+template<size_t D>
+float fp16_l2_sqr_scalar(const float *q, const uint8_t *code, const float *, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    float dist = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint16_t h;
+        std::memcpy(&h, code + i * sizeof(uint16_t), sizeof(uint16_t));
+        float d = q[i] - half_to_float(h);
+        dist += d * d;
+    }
+    return dist;
+}
+
+#ifdef HNSW_X86
+
+// every cpu with avx2 also has f16c, so the avx2 fp16 kernel relies on it
+template<size_t D>
+__attribute__((target("avx2,fma")))
+float sq8_l2_sqr_avx2(const float *q, const uint8_t *code, const float *params, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const float *min = params;
+    const float *step = params + n;
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i)));
+        __m256 x = _mm256_fmadd_ps(_mm256_cvtepi32_ps(c), _mm256_loadu_ps(step + i), _mm256_loadu_ps(min + i));
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + i), x);
+        sum = _mm256_fmadd_ps(d, d, sum);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float dist = _mm_cvtss_f32(s);
+    if (n % 8 != 0) {
+        for (; i < n; i++) {
+            float d = q[i] - (min[i] + step[i] * code[i]);
+            dist += d * d;
+        }
+    }
+    return dist;
+}
+
+template<size_t D>
+__attribute__((target("avx2,fma,f16c")))
+float fp16_l2_sqr_avx2(const float *q, const uint8_t *code, const float *, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const uint16_t *h = reinterpret_cast<const uint16_t *>(code);
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i)));
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + i), x);
+        sum = _mm256_fmadd_ps(d, d, sum);
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float dist = _mm_cvtss_f32(s);
+    if (i < n) {
+        dist += fp16_l2_sqr_scalar<0>(q + i, code + i * sizeof(uint16_t), nullptr, n - i);
+    }
+    return dist;
+}
+
+template<size_t D>
+__attribute__((target("avx512f")))
+float sq8_l2_sqr_avx512(const float *q, const uint8_t *code, const float *params, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const float *min = params;
+    const float *step = params + n;
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i c = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i)));
+        __m512 x = _mm512_fmadd_ps(_mm512_cvtepi32_ps(c), _mm512_loadu_ps(step + i), _mm512_loadu_ps(min + i));
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(q + i), x);
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    float dist = _mm512_reduce_add_ps(sum);
+    if (n % 16 != 0) {
+        for (; i < n; i++) {
+            float d = q[i] - (min[i] + step[i] * code[i]);
+            dist += d * d;
+        }
+    }
+    return dist;
+}
+
+template<size_t D>
+__attribute__((target("avx512f")))
+float fp16_l2_sqr_avx512(const float *q, const uint8_t *code, const float *, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const uint16_t *h = reinterpret_cast<const uint16_t *>(code);
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(h + i)));
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(q + i), x);
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    float dist = _mm512_reduce_add_ps(sum);
+    if (i < n) {
+        dist += fp16_l2_sqr_scalar<0>(q + i, code + i * sizeof(uint16_t), nullptr, n - i);
+    }
+    return dist;
+}
+
+#endif
+
+#ifdef HNSW_NEON
+
+template<size_t D>
+float sq8_l2_sqr_neon(const float *q, const uint8_t *code, const float *params, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const float *min = params;
+    const float *step = params + n;
+    float32x4_t sum = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t c = vmovl_u8(vld1_u8(code + i));
+        float32x4_t c0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(c)));
+        float32x4_t c1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(c)));
+        float32x4_t d0 = vsubq_f32(vld1q_f32(q + i), vfmaq_f32(vld1q_f32(min + i), c0, vld1q_f32(step + i)));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(q + i + 4),
+                                   vfmaq_f32(vld1q_f32(min + i + 4), c1, vld1q_f32(step + i + 4)));
+        sum = vfmaq_f32(sum, d0, d0);
+        sum = vfmaq_f32(sum, d1, d1);
+    }
+    float dist = vaddvq_f32(sum);
+    for (; i < n; i++) {
+        float d = q[i] - (min[i] + step[i] * code[i]);
+        dist += d * d;
+    }
+    return dist;
+}
+
+template<size_t D>
+float fp16_l2_sqr_neon(const float *q, const uint8_t *code, const float *, size_t dim) {
+    size_t n = D == 0 ? dim : D;
+    const uint16_t *h = reinterpret_cast<const uint16_t *>(code);
+    float32x4_t sum = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(h + i)));
+        float32x4_t d = vsubq_f32(vld1q_f32(q + i), x);
+        sum = vfmaq_f32(sum, d, d);
+    }
+    float dist = vaddvq_f32(sum);
+    if (i < n) {
+        dist += fp16_l2_sqr_scalar<0>(q + i, code + i * sizeof(uint16_t), nullptr, n - i);
+    }
+    return dist;
+}
+
+#endif
+
+// there are no sse kernels for codes, the sse level falls back to scalar
+template<size_t D>
+code_dist_func_t code_l2_sqr_kernel(storage_type type, simd_level level) {
+    bool int8 = type == storage_type::int8;
+    switch (level) {
+#ifdef HNSW_X86
+        case simd_level::avx512:
+            return int8 ? sq8_l2_sqr_avx512<D> : fp16_l2_sqr_avx512<D>;
+        case simd_level::avx2:
+            return int8 ? sq8_l2_sqr_avx2<D> : fp16_l2_sqr_avx2<D>;
+#endif
+#ifdef HNSW_NEON
+        case simd_level::neon:
+            return int8 ? sq8_l2_sqr_neon<D> : fp16_l2_sqr_neon<D>;
+#endif
+        default:
+            return int8 ? sq8_l2_sqr_scalar<D> : fp16_l2_sqr_scalar<D>;
+    }
+}
+
+// fastest code kernel for the storage type and dimension, specialized like get_l2_sqr
+inline code_dist_func_t get_code_l2_sqr(storage_type type, size_t dim, simd_level level = cpu_simd_level()) {
+    switch (dim) {
+        case 25:
+            return code_l2_sqr_kernel<25>(type, level);
+        case 100:
+            return code_l2_sqr_kernel<100>(type, level);
+        case 128:
+            return code_l2_sqr_kernel<128>(type, level);
+        case 200:
+            return code_l2_sqr_kernel<200>(type, level);
+        default:
+            return code_l2_sqr_kernel<0>(type, level);
+    }
+}
+
+#endif //UNTITLED_QUANTIZATION_H
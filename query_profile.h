@@ -0,0 +1,205 @@
+#ifndef UNTITLED_QUERY_PROFILE_H
+#define UNTITLED_QUERY_PROFILE_H
+
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+// counts of non-negative integers in log-linear buckets, like an hdr histogram: values below SUB_BUCKETS have a
+// bucket each and every power of two range above is split into SUB_BUCKETS equal buckets, so a percentile is
+// known to within 1 / SUB_BUCKETS (3%) of its value at any scale. the buckets are allocated on the first record
+// and the range of non-empty ones is tracked, so merging a histogram that holds one query costs one bucket.
+class log_histogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = (size_t) 1 << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t min_value = UINT64_MAX;
+    uint64_t max_value = 0;
+    size_t lowest = BUCKETS;                     // non-empty buckets are in [lowest, highest]
+    size_t highest = 0;
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+    }
+
+    // largest value that falls into bucket b
+    static uint64_t bucket_end(size_t b) {
+        if (b < SUB_BUCKETS) {
+            return b;
+        }
+        int shift = (int) (b / SUB_BUCKETS) - 1;
+        return ((b % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    void add_to_bucket(size_t b, uint64_t n) {
+        if (counts.empty()) {
+            counts.assign(BUCKETS, 0);
+        }
+        counts[b] += n;
+        lowest = std::min(lowest, b);
+        highest = std::max(highest, b);
+    }
+
+public:
+    void record(uint64_t value) {
+        add_to_bucket(bucket_of(value), 1);
+        total++;
+        sum += value;
+        min_value = std::min(min_value, value);
+        max_value = std::max(max_value, value);
+    }
+
+    void merge(const log_histogram &other) {
+        for (size_t b = other.lowest; b <= other.highest && b < BUCKETS; b++) {
+            if (other.counts[b] != 0) {
+                add_to_bucket(b, other.counts[b]);
+            }
+        }
+        total += other.total;
+        sum += other.sum;
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    // empties the histogram, touching only the buckets that were used
+    void clear() {
+        for (size_t b = lowest; b <= highest && b < BUCKETS; b++) {
+            counts[b] = 0;
+        }
+        total = sum = max_value = 0;
+        min_value = UINT64_MAX;
+        lowest = BUCKETS;
+        highest = 0;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return total == 0 ? 0 : min_value;
+    }
+
+    uint64_t max() const {
+        return max_value;
+    }
+
+    double mean() const {
+        return total == 0 ? 0 : (double) sum / total;
+    }
+
+    // smallest value v such that a fraction p of the recorded values are <= v, up to the bucket resolution.
+    // the upper end of the bucket is reported, so tail percentiles are never underestimated.
+    uint64_t percentile(double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max((uint64_t) 1, (uint64_t) std::ceil(p * total));
+        uint64_t seen = 0;
+        for (size_t b = lowest; b <= highest; b++) {
+            seen += counts[b];
+            if (seen >= rank) {
+                return std::min(bucket_end(b), max_value);
+            }
+        }
+        return max_value;
+    }
+
+    void write_json(std::ostream &out) const {
+        out << "{\"count\": " << total << ", \"min\": " << min() << ", \"mean\": " << mean() << ", \"p50\": "
+            << percentile(0.5) << ", \"p90\": " << percentile(0.9) << ", \"p99\": " << percentile(0.99)
+            << ", \"p999\": " << percentile(0.999) << ", \"max\": " << max_value << "}";
+    }
+};
+
+// work done on one layer, summed over the profiled queries
+struct layer_counters {
+    unsigned long long int hops = 0;               // nodes whose links were scanned
+    unsigned long long int distances = 0;          // distance evaluations
+    unsigned long long int visited = 0;            // nodes whose distance was taken
+    unsigned long long int heap_operations = 0;    // pushes and pops of the candidate and result heaps
+
+    void add(const layer_counters &other) {
+        hops += other.hops;
+        distances += other.distances;
+        visited += other.visited;
+        heap_operations += other.heap_operations;
+    }
+};
+
+// per-query profile of knn_search, see basic_hnsw::set_profiling. latencies are in nanoseconds from the call to
+// the last result written, the per-query histograms hold the totals of a query over all layers.
+struct query_profile {
+    unsigned long long int queries = 0;
+    log_histogram latency_ns;
+    log_histogram hops;
+    log_histogram distances;
+    log_histogram visited;
+    log_histogram heap_operations;
+    std::vector<layer_counters> layers;            // layers[lc] sums layer lc over the queries, kept by clear
+
+    // folds other into this profile and empties other
+    void merge(query_profile &other) {
+        queries += other.queries;
+        latency_ns.merge(other.latency_ns);
+        hops.merge(other.hops);
+        distances.merge(other.distances);
+        visited.merge(other.visited);
+        heap_operations.merge(other.heap_operations);
+        if (layers.size() < other.layers.size()) {
+            layers.resize(other.layers.size());
+        }
+        for (size_t lc = 0; lc < other.layers.size(); lc++) {
+            layers[lc].add(other.layers[lc]);
+        }
+        other.clear();
+    }
+
+    void clear() {
+        queries = 0;
+        latency_ns.clear();
+        hops.clear();
+        distances.clear();
+        visited.clear();
+        heap_operations.clear();
+        std::fill(layers.begin(), layers.end(), layer_counters());
+    }
+
+    void write_json(std::ostream &out) const {
+        out << "{\n  \"queries\": " << queries << ",\n  \"latency_ns\": ";
+        latency_ns.write_json(out);
+        out << ",\n  \"hops\": ";
+        hops.write_json(out);
+        out << ",\n  \"distances\": ";
+        distances.write_json(out);
+        out << ",\n  \"visited\": ";
+        visited.write_json(out);
+        out << ",\n  \"heap_operations\": ";
+        heap_operations.write_json(out);
+        out << ",\n  \"layers\": [";
+        for (size_t lc = 0; lc < layers.size(); lc++) {
+            const layer_counters &l = layers[lc];
+            double per_query = queries == 0 ? 0 : 1.0 / queries;
+            out << (lc == 0 ? "\n" : ",\n") << "    {\"level\": " << lc << ", \"hops\": " << l.hops
+                << ", \"distances\": " << l.distances << ", \"visited\": " << l.visited << ", \"heap_operations\": "
+                << l.heap_operations << ", \"hops_per_query\": " << l.hops * per_query
+                << ", \"distances_per_query\": " << l.distances * per_query << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+#endif //UNTITLED_QUERY_PROFILE_H
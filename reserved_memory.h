@@ -0,0 +1,74 @@
+#ifndef UNTITLED_RESERVED_MEMORY_H
+#define UNTITLED_RESERVED_MEMORY_H
+
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+
+// anonymous mapping that reserves address space up front and makes it usable chunk by chunk. an array kept
+// in it grows in place: its address never changes, so readers holding pointers into it are never invalidated.
+// reserved pages cost no memory, committed pages are zero until written.
+class reserved_memory {
+private:
+    char *addr = nullptr;
+    size_t reserved = 0;
+    size_t committed = 0;
+
+public:
+    static constexpr size_t CHUNK = 1 << 21;    // commit granularity, 2 MB
+
+    explicit reserved_memory(size_t bytes) {
+        reserved = (bytes + CHUNK - 1) / CHUNK * CHUNK;
+        if (reserved > 0) {
+            void *p = ::mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::runtime_error("reserved_memory: cannot reserve " + std::to_string(reserved) +
+                                         " bytes: " + std::strerror(errno));
+            }
+            addr = static_cast<char *>(p);
+        }
+    }
+
+    ~reserved_memory() {
+        if (addr != nullptr) {
+            ::munmap(addr, reserved);
+        }
+    }
+
+    reserved_memory(const reserved_memory &) = delete;
+
+    reserved_memory &operator=(const reserved_memory &) = delete;
+
+    // makes the first bytes usable, rounded up to whole chunks. committed memory is never given back.
+    void commit(size_t bytes) {
+        if (bytes <= committed) {
+            return;
+        }
+        if (bytes > reserved) {
+            throw std::runtime_error("reserved_memory: " + std::to_string(bytes) + " bytes exceed the reservation of " +
+                                     std::to_string(reserved));
+        }
+        size_t end = std::min((bytes + CHUNK - 1) / CHUNK * CHUNK, reserved);
+        if (::mprotect(addr + committed, end - committed, PROT_READ | PROT_WRITE) != 0) {
+            throw std::runtime_error(std::string("reserved_memory: cannot commit memory: ") + std::strerror(errno));
+        }
+        committed = end;
+    }
+
+    char *data() const {
+        return addr;
+    }
+
+    size_t size() const {
+        return committed;
+    }
+
+    size_t capacity() const {
+        return reserved;
+    }
+};
+
+#endif //UNTITLED_RESERVED_MEMORY_H